@@ -1,37 +1,59 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
-#include <algorithm>
-#include <iomanip>
-
-int main() {
-    std::string flag = "FLAG{Sh@hab_D3bug_M3m0ry_P4tch_1s_C00l}";
-
-    std::string static_key = "PATCH";
-
-    std::string dynamic_key = "THIS_IS_MASTER_KEY_TO_DECRYPT";
-
-    std::vector<unsigned char> temp_data1;
-    for (size_t i = 0; i < flag.length(); ++i) {
-        temp_data1.push_back(flag[i] ^ static_key[i % static_key.length()]);
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include "payload_generator.hpp"
+
+// Usage:
+//   0625_new_flag_generator                      prints the payload for the built-in flag
+//   0625_new_flag_generator --batch=<file> --out=<dir> [--threads=N]
+//                                                writes <dir>/<name>.h for every line of <file>
+// Batch lines are name<TAB>flag[<TAB>static_key[<TAB>dynamic_key]]; see payload_generator.hpp.
+int main(int argc, char* argv[]) {
+    const char* batch_path = nullptr;
+    const char* out_dir = ".";
+    unsigned threads = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_path = argv[i] + 8;
+        } else if (std::strncmp(argv[i], "--out=", 6) == 0) {
+            out_dir = argv[i] + 6;
+        } else if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = static_cast<unsigned>(std::strtoul(argv[i] + 10, nullptr, 10));
+        }
     }
 
-    std::reverse(temp_data1.begin(), temp_data1.end());
+    if (batch_path == nullptr) {
+        std::string flag = "FLAG{Sh@hab_D3bug_M3m0ry_P4tch_1s_C00l}";
 
-    std::vector<unsigned char> final_payload;
-    for (size_t i = 0; i < temp_data1.size(); ++i) {
-        final_payload.push_back(temp_data1[i] ^ dynamic_key[i % dynamic_key.length()]);
+        PayloadScratch scratch;
+        generate_payload_text(flag, DEFAULT_STATIC_KEY, DEFAULT_DYNAMIC_KEY, scratch);
+        std::fwrite(scratch.text.data(), 1, scratch.text.size(), stdout);
+        return 0;
     }
 
-    std::cout << "unsigned char encrypted_flag_payload[] = {" << std::endl;
-    for (size_t i = 0; i < final_payload.size(); ++i) {
-        if (i % 12 == 0) std::cout << "    ";
-        std::cout << "0x" << std::hex << std::setw(2) << std::setfill('0') << (int)final_payload[i];
-        if (i < final_payload.size() - 1) std::cout << ", ";
-        if ((i + 1) % 12 == 0) std::cout << std::endl;
+    std::ifstream file(batch_path, std::ios::binary);
+    if (!file) {
+        std::cerr << "cannot open " << batch_path << std::endl;
+        return 1;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    const std::string text = contents.str();
+
+    std::vector<PayloadJob> jobs;
+    std::string error;
+    if (!parse_payload_jobs(text, jobs, error)) {
+        std::cerr << batch_path << ": " << error << std::endl;
+        return 1;
     }
-    std::cout << std::endl << "};" << std::endl;
-    std::cout << "const size_t payload_size = sizeof(encrypted_flag_payload);" << std::endl;
 
-    return 0;
+    const size_t failed = run_payload_batch(jobs, out_dir, threads);
+    std::cerr << (jobs.size() - failed) << " of " << jobs.size() << " payloads written to " << out_dir << std::endl;
+    return failed == 0 ? 0 : 1;
 }
\ No newline at end of file
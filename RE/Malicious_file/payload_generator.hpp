@@ -0,0 +1,263 @@
+// Encrypted flag payloads for the "Patch Me If You Can" challenge:
+//   payload = reverse(flag ^ static_key) ^ dynamic_key
+// with both keys repeated over the flag. The XOR/reverse kernel, the hex
+// formatter and the batch runner behind 0625_new_flag_generator.cpp.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+inline constexpr std::string_view DEFAULT_STATIC_KEY = "PATCH";
+inline constexpr std::string_view DEFAULT_DYNAMIC_KEY = "THIS_IS_MASTER_KEY_TO_DECRYPT";
+
+// The block kernel uses GCC/Clang vector extensions; elsewhere the scalar
+// loop handles every byte.
+#if defined(__GNUC__) || defined(__clang__)
+#define PAYLOAD_HAS_VECTOR_KERNEL 1
+typedef unsigned char payload_u8x16 __attribute__((vector_size(16)));
+
+inline payload_u8x16 reverse_bytes(payload_u8x16 v) {
+#if defined(__clang__)
+    return __builtin_shufflevector(v, v, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+#else
+    const payload_u8x16 order = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+    return __builtin_shuffle(v, order);
+#endif
+}
+#endif
+
+// Reused between payloads so a worker allocates only when a key or flag is
+// longer than any it has seen.
+struct PayloadScratch {
+    std::string static_key;    // key repeated out to size() + 16 bytes
+    std::string dynamic_key;
+    std::vector<unsigned char> payload;
+    std::string text;
+};
+
+// Repeats key to key.size() + 16 bytes, so the 16 key bytes for any phase
+// are one unaligned load. An empty key acts as a single zero byte.
+inline void repeat_key(std::string_view key, std::string& out) {
+    const std::string_view zero("\0", 1);
+    if (key.empty()) {
+        key = zero;
+    }
+    out.resize(key.size() + 16);
+    for (size_t i = 0; i < out.size(); ++i) {
+        out[i] = key[i % key.size()];
+    }
+}
+
+// out[i] = flag[n-1-i] ^ static_key[(n-1-i) % s] ^ dynamic_key[i % d], i.e.
+// both XOR stages and the reverse in one pass. out must hold flag.size() bytes.
+inline void encrypt_flag_payload(std::string_view flag, std::string_view static_key, std::string_view dynamic_key,
+                                 unsigned char* out, PayloadScratch& scratch) {
+    repeat_key(static_key, scratch.static_key);
+    repeat_key(dynamic_key, scratch.dynamic_key);
+    const size_t static_size = scratch.static_key.size() - 16;
+    const size_t dynamic_size = scratch.dynamic_key.size() - 16;
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(flag.data());
+    const unsigned char* sk = reinterpret_cast<const unsigned char*>(scratch.static_key.data());
+    const unsigned char* dk = reinterpret_cast<const unsigned char*>(scratch.dynamic_key.data());
+    const size_t n = flag.size();
+    size_t i = 0;
+
+#ifdef PAYLOAD_HAS_VECTOR_KERNEL
+    if (n >= 16) {
+        // Output block [i, i + 16) comes from input block [n - i - 16, n - i).
+        size_t static_phase = (n - 16) % static_size;
+        size_t dynamic_phase = 0;
+        const size_t static_step = 16 % static_size;
+        const size_t dynamic_step = 16 % dynamic_size;
+        for (; i + 16 <= n; i += 16) {
+            payload_u8x16 data, static_bytes, dynamic_bytes;
+            std::memcpy(&data, in + (n - i - 16), 16);
+            std::memcpy(&static_bytes, sk + static_phase, 16);
+            std::memcpy(&dynamic_bytes, dk + dynamic_phase, 16);
+            data = reverse_bytes(data ^ static_bytes) ^ dynamic_bytes;
+            std::memcpy(out + i, &data, 16);
+
+            static_phase = static_phase >= static_step ? static_phase - static_step
+                                                       : static_phase + static_size - static_step;
+            dynamic_phase += dynamic_step;
+            if (dynamic_phase >= dynamic_size) {
+                dynamic_phase -= dynamic_size;
+            }
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        const size_t j = n - 1 - i;
+        out[i] = in[j] ^ sk[j % static_size] ^ dk[i % dynamic_size];
+    }
+}
+
+// Upper bound on format_payload's output for a payload of `size` bytes.
+inline size_t formatted_payload_capacity(size_t size) {
+    return 64 + 6 * size + 5 * (size / 12 + 1) + 64;
+}
+
+// Writes the C array declaration the original generator printed, byte for
+// byte, into out (at least formatted_payload_capacity(size) bytes).
+// Returns the number of bytes written.
+inline size_t format_payload(const unsigned char* payload, size_t size, char* out) {
+    static const char HEX[] = "0123456789abcdef";
+    static const char HEADER[] = "unsigned char encrypted_flag_payload[] = {\n";
+    static const char FOOTER[] = "\n};\nconst size_t payload_size = sizeof(encrypted_flag_payload);\n";
+    char* p = out;
+    std::memcpy(p, HEADER, sizeof(HEADER) - 1);
+    p += sizeof(HEADER) - 1;
+    for (size_t i = 0; i < size; ++i) {
+        if (i % 12 == 0) {
+            std::memcpy(p, "    ", 4);
+            p += 4;
+        }
+        p[0] = '0';
+        p[1] = 'x';
+        p[2] = HEX[payload[i] >> 4];
+        p[3] = HEX[payload[i] & 0x0F];
+        p += 4;
+        if (i < size - 1) {
+            p[0] = ',';
+            p[1] = ' ';
+            p += 2;
+        }
+        if ((i + 1) % 12 == 0) {
+            *p++ = '\n';
+        }
+    }
+    std::memcpy(p, FOOTER, sizeof(FOOTER) - 1);
+    p += sizeof(FOOTER) - 1;
+    return static_cast<size_t>(p - out);
+}
+
+// Encrypts and formats one flag into scratch.text.
+inline void generate_payload_text(std::string_view flag, std::string_view static_key, std::string_view dynamic_key,
+                                  PayloadScratch& scratch) {
+    if (scratch.payload.size() < flag.size()) {
+        scratch.payload.resize(flag.size());
+    }
+    encrypt_flag_payload(flag, static_key, dynamic_key, scratch.payload.data(), scratch);
+    scratch.text.resize(formatted_payload_capacity(flag.size()));
+    scratch.text.resize(format_payload(scratch.payload.data(), flag.size(), &scratch.text[0]));
+}
+
+// Writes data to path with a single write on an unbuffered stream.
+inline bool write_whole_file(const std::string& path, std::string_view data) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::setvbuf(file, nullptr, _IONBF, 0);
+    const bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && ok;
+}
+
+// One line of a batch file: name<TAB>flag[<TAB>static_key[<TAB>dynamic_key]].
+// Missing keys fall back to the defaults. The views point into the file text.
+struct PayloadJob {
+    std::string_view name;
+    std::string_view flag;
+    std::string_view static_key = DEFAULT_STATIC_KEY;
+    std::string_view dynamic_key = DEFAULT_DYNAMIC_KEY;
+};
+
+// Splits a batch file into jobs, skipping blank lines and '#' comments.
+// Names become file names, so they may not be empty or contain a path
+// separator. The flag and any key given may not be empty either: an empty
+// flag makes an empty array and an empty key has nothing to repeat.
+inline bool parse_payload_jobs(std::string_view text, std::vector<PayloadJob>& jobs, std::string& error) {
+    size_t line_number = 0;
+    while (!text.empty()) {
+        ++line_number;
+        const size_t eol = text.find('\n');
+        std::string_view line = text.substr(0, eol);
+        text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+
+        std::string_view fields[4];
+        size_t count = 0;
+        while (count < 4) {
+            const size_t tab = count < 3 ? line.find('\t') : std::string_view::npos;
+            fields[count++] = line.substr(0, tab);
+            if (tab == std::string_view::npos) {
+                break;
+            }
+            line.remove_prefix(tab + 1);
+        }
+        if (count < 2) {
+            error = "line " + std::to_string(line_number) + ": expected name<TAB>flag";
+            return false;
+        }
+        if (fields[0].empty() || fields[0].find_first_of("/\\") != std::string_view::npos) {
+            error = "line " + std::to_string(line_number) + ": bad payload name";
+            return false;
+        }
+        if (fields[1].empty()) {
+            error = "line " + std::to_string(line_number) + ": empty flag";
+            return false;
+        }
+        if ((count > 2 && fields[2].empty()) || (count > 3 && fields[3].empty())) {
+            error = "line " + std::to_string(line_number) + ": empty key";
+            return false;
+        }
+
+        PayloadJob job;
+        job.name = fields[0];
+        job.flag = fields[1];
+        if (count > 2) job.static_key = fields[2];
+        if (count > 3) job.dynamic_key = fields[3];
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Generates <out_dir>/<name>.h for every job on `threads` workers, each
+// with its own scratch buffers. Returns the number of files that could not
+// be written.
+inline size_t run_payload_batch(const std::vector<PayloadJob>& jobs, const std::string& out_dir, unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(jobs.size(), 1)));
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failed{0};
+    auto worker = [&] {
+        PayloadScratch scratch;
+        std::string path;
+        for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < jobs.size();
+             i = next.fetch_add(1, std::memory_order_relaxed)) {
+            const PayloadJob& job = jobs[i];
+            generate_payload_text(job.flag, job.static_key, job.dynamic_key, scratch);
+            path.assign(out_dir).append("/").append(job.name).append(".h");
+            if (!write_whole_file(path, scratch.text)) {
+                std::fprintf(stderr, "failed to write %s\n", path.c_str());
+                failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    return failed.load();
+}
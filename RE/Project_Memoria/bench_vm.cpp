@@ -0,0 +1,923 @@
+// Interpreter benchmarks for the Project Memoria VMs.
+//
+// Build next to the game, with the same flags it ships with:
+//   g++ -std=c++17 -O2 -pthread -o bench_vm bench_vm.cpp
+//
+// Usage: bench_vm [--runs=N] [--filter=<substring>] [--json=<path>]
+//        bench_vm --selftest
+//
+// Every case is run --runs times (default 1000, tight loops and opcode
+// microbenchmarks use a tenth of that). Each run starts from a fresh
+// VirtualMachine and is timed on its own; the table reports ns per retired
+// instruction, instructions per second and the p50/p99 latency of a single
+// run. --json writes the same numbers as a JSON array for comparing builds.
+// GET_TICK reads the virtual clock everywhere except the clock/* cases, so
+// no case enters the kernel for time and every run retires the same
+// instructions. --selftest runs no benchmarks: it checks PatternSet and
+// MatchSink against std::string_view::find over random pattern sets, and
+// ResumableVm against a blocking run, and exits 1 on any mismatch.
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <cstdio>
+
+#include "memoria_backends.hpp"
+#include "memoria_programs.hpp"
+#include "memoria_text.hpp"
+#include "memoria_clock.hpp"
+#include "memoria_game.hpp"
+
+using ChallengeBenchVm = VmTraits<ChallengeOpcodes, AttachedIo, PlainHalt>;
+
+const char* const HAKONIWA_PASSWORD = "CORE-0B-COMPLETE\n";
+const char* const CHALLENGE_PASSWORD = "CORE-0B-COMPLETE";
+
+// Throws away PUTC output without ever taking the slow path twice.
+class NullSink : public OutputSink {
+public:
+    NullSink() {
+        cursor_ = block_;
+        limit_ = block_ + sizeof(block_);
+    }
+
+protected:
+    bool overflow() override {
+        cursor_ = block_;
+        return true;
+    }
+
+private:
+    char block_[4096];
+};
+
+struct BenchResult {
+    std::string name;
+    std::string backend;
+    const char* unit = "insn";   // what items_per_run counts
+    size_t runs = 0;
+    uint64_t items_per_run = 0;
+    double ns_per_item = 0;
+    double items_per_second = 0;
+    double p50_ns = 0;
+    double p99_ns = 0;
+    // Opcode microbenchmarks only: cost of one extra instruction of that
+    // opcode over the empty loop, in ns; negative when not applicable.
+    double marginal_ns = -1;
+};
+
+struct BenchOptions {
+    size_t runs = 1000;
+    std::string filter;
+    std::string json_path;
+};
+
+// prepare() runs untimed before every run; body() is the timed part and
+// returns how many items (instructions or bytes) the run processed.
+BenchResult measure(const std::string& name, const std::string& backend, size_t runs,
+                    const std::function<void()>& prepare, const std::function<uint64_t()>& body) {
+    using clock = std::chrono::steady_clock;
+
+    for (size_t i = 0; i < runs / 10 + 1; ++i) {
+        prepare();
+        body();
+    }
+
+    std::vector<double> samples;
+    samples.reserve(runs);
+    uint64_t items = 0;
+    double total_ns = 0;
+    for (size_t i = 0; i < runs; ++i) {
+        prepare();
+        auto start = clock::now();
+        items = body();
+        auto stop = clock::now();
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        samples.push_back(ns);
+        total_ns += ns;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.name = name;
+    result.backend = backend;
+    result.runs = runs;
+    result.items_per_run = items;
+    const double total_items = static_cast<double>(items) * runs;
+    result.ns_per_item = total_items > 0 ? total_ns / total_items : 0;
+    result.items_per_second = total_ns > 0 ? total_items * 1e9 / total_ns : 0;
+    result.p50_ns = samples[samples.size() / 2];
+    result.p99_ns = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+    return result;
+}
+
+// One bytecode image prepared for one backend; decoding and JIT compilation
+// happen here, outside the timed region.
+class HakoniwaRunner {
+public:
+    HakoniwaRunner(BytecodeView bytecode, DispatchMode mode) : bytecode_(bytecode.begin(), bytecode.end()), mode_(mode) {
+        if (mode == DispatchMode::Decoded || mode == DispatchMode::Jit) {
+            std::string error;
+            if (!decode_bytecode(bytecode_, program_, error)) {
+                error_ = error;
+                return;
+            }
+            if (mode == DispatchMode::Decoded) {
+                fuse_superinstructions(program_);
+            }
+        }
+#ifdef MEMORIA_HAS_JIT
+        if (mode == DispatchMode::Jit && !jit_.compile(program_)) {
+            error_ = "jit compilation failed";
+        }
+#else
+        if (mode == DispatchMode::Jit) {
+            error_ = "jit not available in this build";
+        }
+#endif
+#ifndef MEMORIA_HAS_THREADED_DISPATCH
+        if (mode == DispatchMode::Threaded) {
+            error_ = "threaded dispatch not available in this build";
+        }
+#endif
+    }
+
+    const std::string& error() const { return error_; }
+
+    void run(VirtualMachine& vm) const {
+        switch (mode_) {
+            case DispatchMode::Switch:
+                run_vm_switch<HakoniwaVm>(vm, bytecode_);
+                break;
+            case DispatchMode::Threaded:
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+                run_vm_threaded<HakoniwaVm>(vm, bytecode_);
+#endif
+                break;
+            case DispatchMode::Decoded:
+                run_decoded(vm, program_);
+                break;
+            case DispatchMode::Jit:
+#ifdef MEMORIA_HAS_JIT
+                jit_.run(vm, program_);
+#endif
+                break;
+        }
+    }
+
+private:
+    std::vector<uint8_t> bytecode_;
+    DispatchMode mode_;
+    DecodedProgram program_;
+#ifdef MEMORIA_HAS_JIT
+    JitProgram jit_;
+#endif
+    std::string error_;
+};
+
+struct BackendChoice {
+    const char* name;
+    DispatchMode mode;
+};
+
+const BackendChoice hakoniwa_backends[] = {
+    {"switch", DispatchMode::Switch},
+    {"threaded", DispatchMode::Threaded},
+    {"decoded", DispatchMode::Decoded},
+    {"jit", DispatchMode::Jit},
+};
+
+class BenchSuite {
+public:
+    explicit BenchSuite(const BenchOptions& options) : options_(options) {}
+
+    const std::vector<BenchResult>& results() const { return results_; }
+
+    void run_all() {
+        bench_startup();
+        bench_challenge();
+        bench_hakoniwa();
+        bench_tight_loop();
+        bench_opcodes();
+        bench_clocks();
+        bench_text();
+        bench_story();
+        bench_match();
+        bench_session();
+    }
+
+private:
+    bool selected(const std::string& name, const std::string& backend) const {
+        return options_.filter.empty() || (name + "/" + backend).find(options_.filter) != std::string::npos;
+    }
+
+    void record(const BenchResult& result) {
+        results_.push_back(result);
+        print_row(result);
+    }
+
+    static void print_row(const BenchResult& r) {
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-24s %-9s %10llu %-4s %9.2f ns/%-4s %12.0f /s   p50 %10.0f ns   p99 %10.0f ns",
+                      r.name.c_str(), r.backend.c_str(), static_cast<unsigned long long>(r.items_per_run), r.unit,
+                      r.ns_per_item, r.unit, r.items_per_second, r.p50_ns, r.p99_ns);
+        std::cout << line;
+        if (r.marginal_ns >= 0) {
+            std::snprintf(line, sizeof(line), "   +%.2f ns/op", r.marginal_ns);
+            std::cout << line;
+        }
+        std::cout << '\n';
+    }
+
+    // Runs bytecode on every Hakoniwa backend with the given input.
+    void bench_hakoniwa_program(const std::string& name, BytecodeView bytecode,
+                                const std::string& input, size_t runs, double* baseline_ns = nullptr,
+                                uint64_t extra_per_run = 0) {
+        for (const BackendChoice& backend : hakoniwa_backends) {
+            if (!selected(name, backend.name)) {
+                continue;
+            }
+            HakoniwaRunner runner(bytecode, backend.mode);
+            if (!runner.error().empty()) {
+                std::cout << name << "/" << backend.name << ": skipped (" << runner.error() << ")\n";
+                continue;
+            }
+            VirtualMachine vm;
+            SpanInput in;
+            NullSink out;
+            BenchResult result = measure(name, backend.name, runs,
+                [&] {
+                    vm = VirtualMachine();
+                    in.reset(input);
+                    vm.input = &in;
+                    vm.output = &out;
+                    vm.clock = &virtual_clock_;
+                },
+                [&] {
+                    runner.run(vm);
+                    return vm.instructions;
+                });
+            if (baseline_ns != nullptr && extra_per_run > 0) {
+                size_t slot = &backend - hakoniwa_backends;
+                if (baseline_ns[slot] >= 0) {
+                    result.marginal_ns = std::max(0.0, (result.p50_ns - baseline_ns[slot]) / extra_per_run);
+                }
+            }
+            record(result);
+        }
+    }
+
+    // The game's startup path: allocating the image and decrypting the four
+    // chunks into it. startup/decrypt-1MiB decrypts a large payload into a
+    // preallocated image with single-byte and repeating multi-byte keys.
+    void bench_startup() {
+        const std::string name = "startup/decrypt";
+        if (selected(name, "image")) {
+            ProgramImage image;
+            BenchResult result = measure(name, "image", options_.runs,
+                [&] { image = ProgramImage(); },
+                [&] {
+                    image = load_hakoniwa_image();
+                    return static_cast<uint64_t>(image.size());
+                });
+            result.unit = "byte";
+            record(result);
+        }
+
+        const std::string large_name = "startup/decrypt-1MiB";
+        std::vector<uint8_t> payload(1 << 20);
+        uint32_t seed = 0x12345678;
+        for (uint8_t& byte : payload) {
+            seed = seed * 1664525 + 1013904223;
+            byte = static_cast<uint8_t>(seed >> 24);
+        }
+        const uint8_t key[] = "Alpha, Foxtrot. Not even a moment's hesitation will be tolerated.";
+        for (size_t key_size : {size_t(1), size_t(7), sizeof(key) - 1}) {
+            const std::string backend = "key" + std::to_string(key_size);
+            if (!selected(large_name, backend)) {
+                continue;
+            }
+            ProgramImage image(payload.size());
+            BenchResult result = measure(large_name, backend, loop_runs(),
+                [&] { image.clear(); },
+                [&] {
+                    image.append_decrypted(payload, key, key_size);
+                    return static_cast<uint64_t>(image.size());
+                });
+            result.unit = "byte";
+            record(result);
+        }
+    }
+
+    void bench_challenge() {
+        const std::string name = "challenge";
+        struct Variant {
+            const char* backend;
+            VmStatus (*run)(VirtualMachine&, BytecodeView);
+        };
+        const Variant variants[] = {
+            {"switch", &run_vm_switch<ChallengeBenchVm>},
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+            {"threaded", &run_vm_threaded<ChallengeBenchVm>},
+#endif
+        };
+        for (const Variant& variant : variants) {
+            if (!selected(name, variant.backend)) {
+                continue;
+            }
+            VirtualMachine vm;
+            SpanInput in;
+            NullSink out;
+            record(measure(name, variant.backend, options_.runs,
+                [&] {
+                    vm = VirtualMachine();
+                    in.reset(CHALLENGE_PASSWORD);
+                    vm.input = &in;
+                    vm.output = &out;
+                    vm.clock = &virtual_clock_;
+                },
+                [&] {
+                    variant.run(vm, challenge_bytecode);
+                    return vm.instructions;
+                }));
+        }
+    }
+
+    void bench_hakoniwa() {
+        const ProgramImage image = load_hakoniwa_image();
+        bench_hakoniwa_program("hakoniwa", image.view(), HAKONIWA_PASSWORD, options_.runs);
+        bench_resumable(image.view());
+    }
+
+    // RESUMABLE_VMS password checks multiplexed on one thread, the way a
+    // server would keep them: every VM is fed one byte of the password per
+    // round, as if each player typed at the same speed, and drained when
+    // its output fills. Counts resumes, so ns/res is the cost of taking one
+    // waiting VM through one keystroke.
+    void bench_resumable(BytecodeView bytecode) {
+        const size_t RESUMABLE_VMS = 10000;
+        const std::string_view password(HAKONIWA_PASSWORD);
+        for (const BackendChoice& backend : hakoniwa_backends) {
+            if (backend.mode == DispatchMode::Decoded || backend.mode == DispatchMode::Jit ||
+                !selected("hakoniwa/resumable", backend.name)) {
+                continue;
+            }
+            std::deque<ResumableVm> vms;
+            uint64_t drained = 0;
+            BenchResult result = measure("hakoniwa/resumable", backend.name, loop_runs(),
+                [&] {
+                    vms.clear();
+                    for (size_t i = 0; i < RESUMABLE_VMS; ++i) {
+                        vms.emplace_back(bytecode, 64, backend.mode);
+                        vms.back().vm().clock = &virtual_clock_;
+                    }
+                },
+                [&] {
+                    uint64_t resumes = 0;
+                    for (size_t round = 0; round <= password.size(); ++round) {
+                        for (ResumableVm& task : vms) {
+                            if (round < password.size()) {
+                                task.feed(password.substr(round, 1));
+                            } else {
+                                task.close_input();
+                            }
+                            while (task.resume() == VmStatus::OutputFull) {
+                                drained += task.output().size();
+                                task.drain();
+                                ++resumes;
+                            }
+                            ++resumes;
+                            if (task.halted()) {
+                                drained += task.output().size();
+                            }
+                        }
+                    }
+                    return resumes;
+                });
+            result.unit = "res";
+            record(result);
+            if (drained == 0) {
+                std::cout << "hakoniwa/resumable/" << backend.name << ": no output\n";
+            }
+        }
+    }
+
+    static void emit_u32(std::vector<uint8_t>& code, uint32_t value) {
+        for (int k = 0; k < 4; ++k) {
+            code.push_back(static_cast<uint8_t>(value >> (8 * k)));
+        }
+    }
+
+    // MOV r0, iterations; MOV r1, 1; loop: body; SUB r0, r1; CMP_VAL r0, 0; JNZ loop; HALT
+    static std::vector<uint8_t> counted_loop(uint32_t iterations, const std::vector<uint8_t>& op, int copies) {
+        std::vector<uint8_t> code;
+        code.push_back(0x01); code.push_back(0); emit_u32(code, iterations);
+        code.push_back(0x01); code.push_back(1); emit_u32(code, 1);
+        const uint16_t loop = static_cast<uint16_t>(code.size());
+        for (int i = 0; i < copies; ++i) {
+            const size_t at = code.size();
+            code.insert(code.end(), op.begin(), op.end());
+            if (op[0] == 0x11) {
+                // JNZ to the next instruction: taken or not, execution continues in order.
+                const uint16_t next = static_cast<uint16_t>(code.size());
+                memcpy(&code[at + 1], &next, 2);
+            }
+        }
+        code.push_back(0x06); code.push_back(0); code.push_back(1);
+        code.push_back(0x12); code.push_back(0); emit_u32(code, 0);
+        code.push_back(0x11); code.push_back(static_cast<uint8_t>(loop)); code.push_back(static_cast<uint8_t>(loop >> 8));
+        code.push_back(0xFF);
+        return code;
+    }
+
+    void bench_tight_loop() {
+        bench_hakoniwa_program("loop/sub-cmp-jnz", counted_loop(100000, {}, 0), "", loop_runs());
+    }
+
+    void bench_opcodes() {
+        const uint32_t iterations = 1000;
+        const int copies = 16;
+        struct OpcodeCase {
+            const char* name;
+            std::vector<uint8_t> encoding;
+        };
+        const OpcodeCase cases[] = {
+            {"MOV_VAL", {0x01, 2, 0x78, 0x56, 0x34, 0x12}},
+            {"STORE", {0x04, 0x10, 2}},
+            {"ADD", {0x05, 2, 3}},
+            {"SUB", {0x06, 2, 3}},
+            {"XOR_REG", {0x07, 2, 3}},
+            {"CMP_MEM", {0x09, 0x10, 2}},
+            {"CMP_REG", {0x10, 2, 3}},
+            {"JNZ", {0x11, 0, 0}},
+            {"CMP_VAL", {0x12, 2, 0x10, 0, 0, 0}},
+            {"GETC", {0x20, 2}},
+            {"PUTC", {0x21, 2}},
+            {"GET_TICK", {0x30, 2}},
+        };
+
+        double baseline_ns[std::size(hakoniwa_backends)];
+        std::fill(std::begin(baseline_ns), std::end(baseline_ns), -1.0);
+        const size_t first_result = results_.size();
+        bench_hakoniwa_program("op/empty-loop", counted_loop(iterations, {}, 0), "", loop_runs());
+        for (size_t i = first_result; i < results_.size(); ++i) {
+            for (size_t b = 0; b < std::size(hakoniwa_backends); ++b) {
+                if (results_[i].backend == hakoniwa_backends[b].name) {
+                    baseline_ns[b] = results_[i].p50_ns;
+                }
+            }
+        }
+
+        const std::string input(static_cast<size_t>(iterations) * copies, 'A');
+        for (const OpcodeCase& c : cases) {
+            bench_hakoniwa_program(std::string("op/") + c.name, counted_loop(iterations, c.encoding, copies), input,
+                                   loop_runs(), baseline_ns, static_cast<uint64_t>(iterations) * copies);
+        }
+    }
+
+    // The GET_TICK loop on the decoded interpreter with each clock provider.
+    void bench_clocks() {
+        const std::vector<uint8_t> code = counted_loop(1000, {0x30, 2}, 16);
+        HakoniwaRunner runner(code, DispatchMode::Decoded);
+        for (const char* name : {"steady", "tsc", "coarse", "virtual"}) {
+            const std::string case_name = std::string("clock/") + name;
+            if (!selected(case_name, "decoded")) {
+                continue;
+            }
+            std::unique_ptr<TickClock> clock = make_tick_clock(name);
+            VirtualMachine vm;
+            record(measure(case_name, "decoded", loop_runs(),
+                [&] {
+                    vm = VirtualMachine();
+                    vm.clock = clock.get();
+                },
+                [&] {
+                    runner.run(vm);
+                    return vm.instructions;
+                }));
+        }
+    }
+
+    // Wrapping a long dialogue line to the game's content width, once with
+    // the 「」 the game adds (broken between glyphs) and once as plain ASCII
+    // (broken between words).
+    void bench_text() {
+        std::string sentence;
+        for (int i = 0; i < 40; ++i) {
+            sentence += "The time I had left was far too short, and all I could do was transfer your consciousness. ";
+        }
+        const std::pair<const char*, std::string> variants[] = {
+            {"glyphs", "Log Entry 「" + sentence + "」"},
+            {"words", sentence},
+        };
+        for (const auto& variant : variants) {
+            if (!selected("text/wrap", variant.first)) {
+                continue;
+            }
+            const std::string& text = variant.second;
+            BenchResult result = measure("text/wrap", variant.first, loop_runs(),
+                [] {},
+                [&] {
+                    const std::vector<TextLine> lines = wrap_text(text, 104);
+                    return static_cast<uint64_t>(lines.empty() ? 0 : text.size());
+                });
+            result.unit = "byte";
+            record(result);
+        }
+    }
+
+    // Validating the built-in story image, which is all a story load does
+    // once the file is mapped.
+    void bench_story() {
+        if (!selected("story/load", "builtin")) {
+            return;
+        }
+        const std::string& image = builtin_story_image();
+        std::string error;
+        BenchResult result = measure("story/load", "builtin", loop_runs(),
+            [] {},
+            [&] {
+                Story story;
+                return static_cast<uint64_t>(story.load(image, error) ? image.size() : 0);
+            });
+        result.unit = "byte";
+        record(result);
+    }
+
+    // Scanning 1 MiB of printable output for the flag marker: "find" is the
+    // std::string_view::find the session used to make, "dfa-1" the same
+    // search on a PatternSet, and "dfa-64" a PatternSet of 64 markers at
+    // once, which costs the same per byte.
+    void bench_match() {
+        std::string text(1 << 20, ' ');
+        uint32_t seed = 0x9E3779B9;
+        for (char& c : text) {
+            seed = seed * 1664525 + 1013904223;
+            c = static_cast<char>(' ' + (seed >> 24) % 95);
+        }
+        text.replace(text.size() - 32, 5, "bsctf");
+
+        PatternSet one;
+        one.add("bsctf");
+        one.compile();
+        PatternSet many;
+        for (int i = 0; i < 63; ++i) {
+            many.add("marker-" + std::to_string(i));
+        }
+        many.add("bsctf");
+        many.compile();
+
+        if (selected("output/match", "find")) {
+            BenchResult result = measure("output/match", "find", loop_runs(), [] {},
+                [&] {
+                    const size_t pos = std::string_view(text).find("bsctf");
+                    return static_cast<uint64_t>(pos != std::string_view::npos ? text.size() : 0);
+                });
+            result.unit = "byte";
+            record(result);
+        }
+        const std::pair<const char*, const PatternSet*> sets[] = {{"dfa-1", &one}, {"dfa-64", &many}};
+        for (const auto& set : sets) {
+            if (!selected("output/match", set.first)) {
+                continue;
+            }
+            BenchResult result = measure("output/match", set.first, loop_runs(), [] {},
+                [&] {
+                    uint32_t state = PatternSet::start();
+                    bool found = false;
+                    set.second->scan(state, text, [&](size_t, size_t) {
+                        found = true;
+                        return true;
+                    });
+                    return static_cast<uint64_t>(found ? text.size() : 0);
+                });
+            result.unit = "byte";
+            record(result);
+        }
+    }
+
+    // A whole game session on HeadlessGameIo: every screen drawn and every
+    // typewriter tick taken, with no terminal and no waiting. "flag" answers
+    // B throughout and enters the password; "bad_end" stops at the first A.
+    void bench_session() {
+        const std::pair<const char*, const char*> scripts[] = {
+            {"flag", "B\nB\nB\nB\nCORE-0B-COMPLETE\n"},
+            {"bad_end", "A\n"},
+        };
+        warm_layout_cache(builtin_story());
+        SessionOptions session_options;
+        session_options.clock = &virtual_clock_;
+        for (const auto& script : scripts) {
+            if (!selected("session/headless", script.first)) {
+                continue;
+            }
+            HeadlessGameIo io;
+            HakoniwaSession session(io);
+            BenchResult result = measure("session/headless", script.first, loop_runs(),
+                [&] { io.reset(script.second); },
+                [&] {
+                    session.run(session_options);
+                    return io.presents();
+                });
+            result.unit = "frm";
+            record(result);
+        }
+    }
+
+    size_t loop_runs() const { return std::max<size_t>(options_.runs / 10, 10); }
+
+    VirtualTickClock virtual_clock_;
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+};
+
+// --selftest: checks that benchmarks take on trust. Every check prints the
+// case that failed and counts it; main() exits 1 if any did.
+class SelfTest {
+public:
+    int run() {
+        check_match_random();
+        check_match_all_bytes();
+        check_match_stop();
+        check_resumable();
+        std::cout << "selftest: " << checks_ << " cases, " << failures_ << " failed" << std::endl;
+        return failures_ == 0 ? 0 : 1;
+    }
+
+private:
+    uint32_t next() {
+        seed_ = seed_ * 1664525 + 1013904223;
+        return seed_ >> 8;
+    }
+
+    std::string random_text(size_t max_length, char first, uint32_t alphabet) {
+        std::string text(next() % (max_length + 1), '\0');
+        for (char& c : text) {
+            c = static_cast<char>(first + next() % alphabet);
+        }
+        return text;
+    }
+
+    void expect(bool ok, const char* what, size_t index) {
+        ++checks_;
+        if (!ok) {
+            ++failures_;
+            std::cerr << "selftest: " << what << " case " << index << " failed" << std::endl;
+        }
+    }
+
+    // Every (end, pattern) pair std::string_view::find sees in `text`.
+    static std::vector<std::pair<size_t, size_t>> find_all(const std::vector<std::string>& patterns,
+                                                            std::string_view text) {
+        std::vector<std::pair<size_t, size_t>> found;
+        for (size_t index = 0; index < patterns.size(); ++index) {
+            const std::string& pattern = patterns[index];
+            if (pattern.empty()) {
+                continue;
+            }
+            for (size_t at = text.find(pattern); at != std::string_view::npos; at = text.find(pattern, at + 1)) {
+                found.emplace_back(at + pattern.size(), index);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    // Scans `text` in chunks of 1..7 bytes, so matches straddle the cuts.
+    std::vector<std::pair<size_t, size_t>> scan_all(const PatternSet& set, std::string_view text) {
+        std::vector<std::pair<size_t, size_t>> found;
+        uint32_t state = PatternSet::start();
+        for (size_t offset = 0; offset < text.size();) {
+            const size_t length = std::min<size_t>(1 + next() % 7, text.size() - offset);
+            set.scan(state, text.substr(offset, length), [&](size_t pattern, size_t end) {
+                found.emplace_back(offset + end, pattern);
+                return true;
+            });
+            offset += length;
+        }
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    // Up to 12 short patterns over a few letters, some empty, against text
+    // that also has a letter no pattern uses; then the same text through a
+    // MatchSink, which must forward it unchanged.
+    void check_match_random() {
+        for (size_t round = 0; round < 3000; ++round) {
+            const uint32_t alphabet = 2 + next() % 4;
+            std::vector<std::string> patterns(1 + next() % 12);
+            PatternSet set;
+            for (std::string& pattern : patterns) {
+                pattern = random_text(4, 'a', alphabet);
+                set.add(pattern);
+            }
+            set.compile();
+            const std::string text = random_text(200, 'a', alphabet + 1);
+            expect(scan_all(set, text) == find_all(patterns, text), "match/random", round);
+
+            ArenaSink forward;
+            MatchSink sink(set, &forward, false, 1 + next() % 9);
+            for (char c : text) {
+                sink.put(c);
+            }
+            sink.flush();
+            bool same = forward.view() == text;
+            for (size_t index = 0; index < patterns.size(); ++index) {
+                const bool occurs = !patterns[index].empty() && text.find(patterns[index]) != std::string::npos;
+                same = same && sink.matched(index) == occurs;
+            }
+            expect(same, "match/sink", round);
+        }
+    }
+
+    // Patterns that between them use all 256 byte values, which takes 257
+    // byte classes. Round 1 is "\0\0", which an 8-bit class index got wrong.
+    void check_match_all_bytes() {
+        std::string every_byte(256, '\0');
+        for (size_t byte = 0; byte < 256; ++byte) {
+            every_byte[byte] = static_cast<char>(byte);
+        }
+        for (size_t round = 0; round < 200; ++round) {
+            std::vector<std::string> patterns = {every_byte, "\xff\xff"};
+            for (uint32_t extra = next() % 6; extra > 0; --extra) {
+                patterns.push_back(random_text(2, '\0', 256));
+            }
+            PatternSet set;
+            for (const std::string& pattern : patterns) {
+                set.add(pattern);
+            }
+            set.compile();
+            std::string text = random_text(600, '\0', 256);
+            for (char& c : text) {
+                if (next() % 3 == 0) {
+                    c = '\xff';
+                }
+            }
+            if (round % 10 == 0) {
+                text += every_byte;
+            }
+            if (round == 1) {
+                text.assign(2, '\0');
+            }
+            expect(scan_all(set, text) == find_all(patterns, text), "match/all-bytes", round);
+        }
+    }
+
+    // stop_at_match with windows of 1..9 bytes: the forwarded output is
+    // exactly the text up to the end of the first match, only a text with
+    // a match stops the sink, and flush() reaches `forward` either way.
+    void check_match_stop() {
+        for (size_t round = 0; round < 2000; ++round) {
+            std::vector<std::string> patterns(1 + next() % 4);
+            PatternSet set;
+            for (std::string& pattern : patterns) {
+                pattern = "a" + random_text(3, 'a', 3);
+                set.add(pattern);
+            }
+            set.compile();
+            const std::string text = random_text(100, 'a', 3);
+            size_t first_end = std::string::npos;
+            for (const std::string& pattern : patterns) {
+                const size_t at = text.find(pattern);
+                if (at != std::string::npos) {
+                    first_end = std::min(first_end, at + pattern.size());
+                }
+            }
+
+            const size_t window = 1 + round % 9;
+            FlushCountingSink forward;
+            MatchSink sink(set, &forward, true, window);
+            for (char c : text) {
+                sink.put(c);
+            }
+            sink.flush();
+            const bool stops = first_end != std::string::npos;
+            const std::string_view want = stops ? std::string_view(text).substr(0, first_end) : text;
+            expect(forward.view() == want && forward.flushes == 1 && sink.stopped() == stops &&
+                       (!stops || sink.first_match_end() == first_end),
+                   "match/stop", round);
+        }
+    }
+
+    // A ResumableVm fed one byte per resume and drained whenever its output
+    // fills ends exactly where a blocking run does: same output, r0, ip and
+    // instruction count. Covers the right, a wrong and an empty password,
+    // each with output buffers of 1, 3 and 64 bytes.
+    void check_resumable() {
+        const ProgramImage image = load_hakoniwa_image();
+        const VirtualTickClock clock;
+        const char* const passwords[] = {HAKONIWA_PASSWORD, "CORE-0X\n", ""};
+        size_t index = 0;
+        for (const BackendChoice& backend : hakoniwa_backends) {
+            if (backend.mode == DispatchMode::Decoded || backend.mode == DispatchMode::Jit) {
+                continue;
+            }
+            for (const char* password : passwords) {
+                VirtualMachine blocking;
+                SpanInput blocking_input(password);
+                ArenaSink blocking_output;
+                blocking.input = &blocking_input;
+                blocking.output = &blocking_output;
+                blocking.clock = &clock;
+                run_vm(blocking, image.view(), DispatchMode::Switch);
+
+                for (size_t capacity : {1, 3, 64}) {
+                    ResumableVm task(image.view(), capacity, backend.mode);
+                    task.vm().clock = &clock;
+                    const std::string_view typed(password);
+                    std::string output;
+                    size_t fed = 0;
+                    for (;;) {
+                        const VmStatus status = task.resume();
+                        if (status == VmStatus::OutputFull) {
+                            output += task.output();
+                            task.drain();
+                        } else if (status == VmStatus::NeedInput && fed < typed.size()) {
+                            task.feed(typed.substr(fed++, 1));
+                        } else if (status == VmStatus::NeedInput) {
+                            task.close_input();
+                        } else {
+                            break;
+                        }
+                    }
+                    output += task.output();
+                    const VirtualMachine& vm = task.vm();
+                    expect(output == blocking_output.view() && vm.registers[0] == blocking.registers[0] &&
+                               vm.ip == blocking.ip && vm.instructions == blocking.instructions,
+                           "resumable", index++);
+                }
+            }
+        }
+    }
+
+    // Counts flush() calls, which a stopped MatchSink must still pass on.
+    class FlushCountingSink : public ArenaSink {
+    public:
+        void flush() override { ++flushes; }
+        size_t flushes = 0;
+    };
+
+    uint32_t seed_ = 1;
+    size_t checks_ = 0;
+    size_t failures_ = 0;
+};
+
+bool write_json(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "  {\"name\": \"%s\", \"backend\": \"%s\", \"unit\": \"%s\", \"runs\": %zu, \"items_per_run\": %llu, "
+                      "\"ns_per_item\": %.4f, \"items_per_second\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f",
+                      r.name.c_str(), r.backend.c_str(), r.unit, r.runs, static_cast<unsigned long long>(r.items_per_run),
+                      r.ns_per_item, r.items_per_second, r.p50_ns, r.p99_ns);
+        out << line;
+        if (r.marginal_ns >= 0) {
+            std::snprintf(line, sizeof(line), ", \"marginal_ns\": %.4f", r.marginal_ns);
+            out << line;
+        }
+        out << (i + 1 < results.size() ? "},\n" : "}\n");
+    }
+    out << "]\n";
+    return static_cast<bool>(out);
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--selftest") == 0) {
+            return SelfTest().run();
+        } else if (std::strncmp(argv[i], "--runs=", 7) == 0) {
+            options.runs = std::max<size_t>(std::strtoul(argv[i] + 7, nullptr, 10), 1);
+        } else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+            options.filter = argv[i] + 9;
+        } else if (std::strncmp(argv[i], "--json=", 7) == 0) {
+            options.json_path = argv[i] + 7;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--runs=N] [--filter=<substring>] [--json=<path>] | --selftest" << std::endl;
+            return 2;
+        }
+    }
+
+    BenchSuite suite(options);
+    suite.run_all();
+
+    if (!options.json_path.empty() && !write_json(options.json_path, suite.results())) {
+        std::cerr << "could not write " << options.json_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Compile-time assembler for VM bytecode. A program is a function that
+// calls one method per instruction on a BytecodeAssembler; assemble() runs
+// it during constant evaluation, resolves labels, optionally XORs the
+// result with a key and returns a constexpr std::array, so images are
+// rodata and a bad branch target is a compile error:
+//
+//   inline constexpr auto source = [](BytecodeAssembler& a) {
+//       AsmLabel loop = a.label();
+//       a.bind(loop);
+//       a.sub(R0, R1);
+//       a.jnz(loop);
+//       a.halt();
+//   };
+//   inline constexpr auto image = assemble<assembled_size(source)>(source);
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+
+// Not constexpr on purpose: reaching it while assembling at compile time
+// fails the build with the message in the diagnostic; at run time it aborts.
+inline void assembler_error(const char* message) {
+    std::fprintf(stderr, "bytecode assembler: %s\n", message);
+    std::abort();
+}
+
+enum AsmRegister : uint8_t { R0, R1, R2, R3 };
+
+struct AsmLabel {
+    uint16_t id;
+};
+
+class BytecodeAssembler {
+public:
+    static constexpr size_t CAPACITY = 4096;
+    static constexpr size_t MAX_LABELS = 64;
+    static constexpr size_t MAX_FIXUPS = 512;
+
+    constexpr AsmLabel label() {
+        if (label_count_ == MAX_LABELS) {
+            assembler_error("too many labels");
+        }
+        return AsmLabel{static_cast<uint16_t>(label_count_++)};
+    }
+
+    // Binds a label to the next instruction (or the end of the program).
+    constexpr void bind(AsmLabel label) {
+        bind_to(label, static_cast<uint16_t>(size_), false);
+    }
+
+    // Binds a label to a fixed address past the end of the program: a jump
+    // there stops the VM as if it had run off the end. finish() checks that
+    // the address really is outside the program.
+    constexpr void bind_exit(AsmLabel label, uint16_t address) {
+        bind_to(label, address, true);
+    }
+
+    constexpr void mov_val(AsmRegister reg, uint32_t value) { emit(0x01); emit(reg); emit_u32(value); }
+    constexpr void store(uint8_t address, AsmRegister reg) { emit(0x04); emit(address); emit(reg); }
+    constexpr void add(AsmRegister dst, AsmRegister src) { emit(0x05); emit(dst); emit(src); }
+    constexpr void sub(AsmRegister dst, AsmRegister src) { emit(0x06); emit(dst); emit(src); }
+    constexpr void xor_reg(AsmRegister dst, AsmRegister src) { emit(0x07); emit(dst); emit(src); }
+    constexpr void cmp_mem(uint8_t address, AsmRegister reg) { emit(0x09); emit(address); emit(reg); }
+    constexpr void cmp_reg(AsmRegister a, AsmRegister b) { emit(0x10); emit(a); emit(b); }
+    constexpr void cmp_val(AsmRegister reg, uint32_t value) { emit(0x12); emit(reg); emit_u32(value); }
+    constexpr void getc(AsmRegister reg) { emit(0x20); emit(reg); }
+    constexpr void putc(AsmRegister reg) { emit(0x21); emit(reg); }
+    constexpr void get_tick(AsmRegister reg) { emit(0x30); emit(reg); }
+    constexpr void fail() { emit(0xFE); }
+    constexpr void halt() { emit(0xFF); }
+
+    constexpr void jnz(AsmLabel target) {
+        if (target.id >= label_count_) {
+            assembler_error("jump to a label from another assembler");
+        }
+        if (fixup_count_ == MAX_FIXUPS) {
+            assembler_error("too many jumps");
+        }
+        emit(0x11);
+        fixups_[fixup_count_++] = Fixup{static_cast<uint16_t>(size_), target.id};
+        emit(0);
+        emit(0);
+    }
+
+    // Patches every jump. Each label must be bound, and exit labels must lie
+    // outside the finished program.
+    constexpr void finish() {
+        for (size_t i = 0; i < label_count_; ++i) {
+            if (!labels_[i].bound) {
+                assembler_error("label used but never bound");
+            }
+            if (labels_[i].exit && labels_[i].address < size_) {
+                assembler_error("exit label lands inside the program");
+            }
+        }
+        for (size_t i = 0; i < fixup_count_; ++i) {
+            const uint16_t address = labels_[fixups_[i].label].address;
+            bytes_[fixups_[i].at] = static_cast<uint8_t>(address);
+            bytes_[fixups_[i].at + 1] = static_cast<uint8_t>(address >> 8);
+        }
+    }
+
+    constexpr size_t size() const { return size_; }
+    constexpr uint8_t operator[](size_t i) const { return bytes_[i]; }
+
+private:
+    struct LabelSlot {
+        uint16_t address = 0;
+        bool bound = false;
+        bool exit = false;
+    };
+    struct Fixup {
+        uint16_t at = 0;
+        uint16_t label = 0;
+    };
+
+    constexpr void bind_to(AsmLabel label, uint16_t address, bool exit) {
+        if (label.id >= label_count_) {
+            assembler_error("binding a label from another assembler");
+        }
+        if (labels_[label.id].bound) {
+            assembler_error("label bound twice");
+        }
+        labels_[label.id] = LabelSlot{address, true, exit};
+    }
+
+    constexpr void emit(uint8_t byte) {
+        if (size_ == CAPACITY) {
+            assembler_error("program exceeds assembler capacity");
+        }
+        bytes_[size_++] = byte;
+    }
+
+    constexpr void emit_u32(uint32_t value) {
+        for (int k = 0; k < 4; ++k) {
+            emit(static_cast<uint8_t>(value >> (8 * k)));
+        }
+    }
+
+    uint8_t bytes_[CAPACITY] = {};
+    size_t size_ = 0;
+    LabelSlot labels_[MAX_LABELS] = {};
+    size_t label_count_ = 0;
+    Fixup fixups_[MAX_FIXUPS] = {};
+    size_t fixup_count_ = 0;
+};
+
+// Size of the program `source` assembles to; the array bound for assemble().
+template <class Source>
+constexpr size_t assembled_size(Source source) {
+    BytecodeAssembler assembler;
+    source(assembler);
+    assembler.finish();
+    return assembler.size();
+}
+
+// The assembled program, every byte XORed with key (0 leaves it in the clear).
+template <size_t N, class Source>
+constexpr std::array<uint8_t, N> assemble(Source source, uint8_t key = 0) {
+    BytecodeAssembler assembler;
+    source(assembler);
+    assembler.finish();
+    if (assembler.size() != N) {
+        assembler_error("array size does not match the program");
+    }
+    std::array<uint8_t, N> image{};
+    for (size_t i = 0; i < N; ++i) {
+        image[i] = static_cast<uint8_t>(assembler[i] ^ key);
+    }
+    return image;
+}
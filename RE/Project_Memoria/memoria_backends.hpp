@@ -0,0 +1,1571 @@
+// Faster backends for the Hakoniwa VM: the pre-decoded interpreter with
+// superinstruction fusion, the x86-64 JIT, and the batch executors that run
+// one program over many inputs. All of them implement HakoniwaVm semantics
+// and fall back to run_vm_switch<HakoniwaVm> for anything they cannot take.
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "memoria_vm.hpp"
+#include "memoria_match.hpp"
+
+// The JIT emits x86-64 System V code into mmap'd pages; elsewhere DispatchMode::Jit
+// runs the decoded interpreter instead.
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(MEMORIA_DISABLE_JIT)
+#define MEMORIA_HAS_JIT 1
+#endif
+
+// The lockstep batch mode is written with GNU vector extensions.
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMORIA_HAS_LOCKSTEP 1
+#endif
+
+const DispatchMode default_dispatch_mode = DispatchMode::Decoded;
+
+// The Hakoniwa VM: the full opcode set, pluggable I/O, and every stop
+// reported through r0.
+using HakoniwaOpcodes = OpcodeSet<0x01, 0x04, 0x05, 0x06, 0x07, 0x09, 0x10, 0x11, 0x12, 0x20, 0x21, 0x30, 0xFE, 0xFF>;
+using HakoniwaVm = VmTraits<HakoniwaOpcodes, AttachedIo, ResultHalt>;
+// The same VM run through ResumableVm: GETC and PUTC suspend instead of blocking.
+using ResumableHakoniwaVm = VmTraits<HakoniwaOpcodes, SuspendingIo, ResultHalt>;
+
+enum class DecodedOp : uint8_t {
+    MovVal,
+    Store,
+    Add,
+    Sub,
+    XorReg,
+    CmpMem,
+    CmpReg,
+    Jnz,
+    CmpVal,
+    Getc,
+    Putc,
+    GetTick,
+    Fail,
+    Halt,
+    Invalid,
+    End,
+    // Superinstructions written by fuse_superinstructions.
+    CheckChar,
+    EmitXor,
+};
+
+// One fixed-width slot per bytecode instruction. Operands are already
+// validated, and a JNZ target is stored as an instruction index.
+struct alignas(8) DecodedInstruction {
+    DecodedOp op = DecodedOp::End;
+    uint8_t a = 0;      // destination register, or memory address for STORE/CMP_MEM
+    uint8_t b = 0;      // source register
+    uint32_t imm = 0;   // immediate value, or branch target index for JNZ
+};
+
+static_assert(sizeof(DecodedInstruction) == 8, "decoded instructions must stay one word wide");
+
+struct DecodedProgram {
+    std::vector<DecodedInstruction> instructions;
+    // Byte offset of each instruction, used to keep vm.ip architecturally
+    // correct whenever execution leaves the decoded loop.
+    std::vector<uint16_t> byte_offsets;
+    // Instruction index for every byte offset in [0, size], -1 inside an instruction.
+    std::vector<int32_t> instruction_at;
+    // The bytecode this was decoded from; it must outlive the program.
+    BytecodeView source;
+};
+
+const int VM_REGISTER_COUNT = 4;
+
+inline bool decode_bytecode(BytecodeView bytecode, DecodedProgram& program, std::string& error) {
+    program = DecodedProgram();
+
+    if (bytecode.size() > 0xFFFF) {
+        error = "bytecode does not fit in the 16-bit address space";
+        return false;
+    }
+
+    const size_t size = bytecode.size();
+    program.instruction_at.assign(size + 1, -1);
+    program.instructions.reserve(size / 2 + 2);
+    program.byte_offsets.reserve(size / 2 + 2);
+
+    // JNZ targets are fixed up after the sweep, once every boundary is known.
+    std::vector<std::pair<size_t, uint16_t>> branches;
+
+    auto check_reg = [&](size_t offset, uint8_t reg_idx) {
+        if (reg_idx < VM_REGISTER_COUNT) return true;
+        error = "invalid register r" + std::to_string(reg_idx) + " at offset " + std::to_string(offset);
+        return false;
+    };
+
+    size_t ip = 0;
+    while (ip < size) {
+        const size_t offset = ip;
+        const uint8_t opcode = bytecode[ip];
+
+        size_t length = 1;
+        switch (opcode) {
+            case 0x01: case 0x12: length = 6; break;
+            case 0x04: case 0x05: case 0x06: case 0x07: case 0x09: case 0x10: case 0x11: length = 3; break;
+            case 0x20: case 0x21: case 0x30: length = 2; break;
+            default: length = 1; break;
+        }
+        if (offset + length > size) {
+            error = "truncated instruction at offset " + std::to_string(offset);
+            return false;
+        }
+
+        const uint8_t* operands = &bytecode[offset + 1];
+        DecodedInstruction insn;
+
+        switch (opcode) {
+            case 0x01:
+            case 0x12:
+                insn.op = (opcode == 0x01) ? DecodedOp::MovVal : DecodedOp::CmpVal;
+                insn.a = operands[0];
+                memcpy(&insn.imm, &operands[1], 4);
+                if (!check_reg(offset, insn.a)) return false;
+                break;
+            case 0x04:
+            case 0x09:
+                // The address operand is a single byte, so it always lies inside the 256-byte memory.
+                insn.op = (opcode == 0x04) ? DecodedOp::Store : DecodedOp::CmpMem;
+                insn.a = operands[0];
+                insn.b = operands[1];
+                if (!check_reg(offset, insn.b)) return false;
+                break;
+            case 0x05:
+            case 0x06:
+            case 0x07:
+            case 0x10:
+                insn.op = (opcode == 0x05) ? DecodedOp::Add
+                        : (opcode == 0x06) ? DecodedOp::Sub
+                        : (opcode == 0x07) ? DecodedOp::XorReg
+                        : DecodedOp::CmpReg;
+                insn.a = operands[0];
+                insn.b = operands[1];
+                if (!check_reg(offset, insn.a) || !check_reg(offset, insn.b)) return false;
+                break;
+            case 0x11: {
+                uint16_t addr = 0;
+                memcpy(&addr, operands, 2);
+                insn.op = DecodedOp::Jnz;
+                branches.emplace_back(program.instructions.size(), addr);
+                break;
+            }
+            case 0x20:
+            case 0x21:
+            case 0x30:
+                insn.op = (opcode == 0x20) ? DecodedOp::Getc
+                        : (opcode == 0x21) ? DecodedOp::Putc
+                        : DecodedOp::GetTick;
+                insn.a = operands[0];
+                if (!check_reg(offset, insn.a)) return false;
+                break;
+            case 0xFE:
+                insn.op = DecodedOp::Fail;
+                break;
+            case 0xFF:
+                insn.op = DecodedOp::Halt;
+                break;
+            default:
+                insn.op = DecodedOp::Invalid;
+                break;
+        }
+
+        program.instruction_at[offset] = static_cast<int32_t>(program.instructions.size());
+        program.instructions.push_back(insn);
+        program.byte_offsets.push_back(static_cast<uint16_t>(offset));
+        ip += length;
+    }
+
+    // Falling off the end of the bytecode stops the VM with vm.ip == size.
+    program.instruction_at[size] = static_cast<int32_t>(program.instructions.size());
+    program.instructions.push_back(DecodedInstruction());
+    program.byte_offsets.push_back(static_cast<uint16_t>(size));
+
+    for (const auto& branch : branches) {
+        const size_t from = branch.first;
+        const uint16_t addr = branch.second;
+        if (addr < size) {
+            if (program.instruction_at[addr] < 0) {
+                error = "JNZ at offset " + std::to_string(program.byte_offsets[from]) +
+                        " targets the middle of an instruction (" + std::to_string(addr) + ")";
+                return false;
+            }
+            program.instructions[from].imm = static_cast<uint32_t>(program.instruction_at[addr]);
+            continue;
+        }
+
+        // A jump past the end stops the VM with vm.ip == addr, so give every
+        // such target its own End slot carrying that address.
+        size_t exit_index = program.instructions.size();
+        for (size_t i = size_t(program.instruction_at[size]); i < program.instructions.size(); ++i) {
+            if (program.byte_offsets[i] == addr) {
+                exit_index = i;
+                break;
+            }
+        }
+        if (exit_index == program.instructions.size()) {
+            program.instructions.push_back(DecodedInstruction());
+            program.byte_offsets.push_back(addr);
+        }
+        program.instructions[from].imm = static_cast<uint32_t>(exit_index);
+    }
+
+    program.source = bytecode;
+    return true;
+}
+
+// Rewrites the two idioms our programs are made of into single dispatches:
+//   GETC a; MOV_VAL b, imm; CMP_REG a, b; JNZ target  ->  CheckChar
+//   MOV_VAL a, imm; XOR_REG a, b; PUTC a               ->  EmitXor
+// Only the first slot of a sequence is rewritten. The remaining slots stay as
+// they were, so the handler can read the JNZ target from them and leave
+// through them on EOF with the same vm.ip as the unfused code. Sequences
+// that contain a branch target after their first slot are left alone.
+// Returns the number of sequences fused.
+inline size_t fuse_superinstructions(DecodedProgram& program) {
+    auto& code = program.instructions;
+
+    std::vector<bool> is_branch_target(code.size(), false);
+    for (const auto& insn : code) {
+        if (insn.op == DecodedOp::Jnz) {
+            is_branch_target[insn.imm] = true;
+        }
+    }
+    auto straight_line = [&](size_t first, size_t count) {
+        if (first + count > code.size()) return false;
+        for (size_t i = first + 1; i < first + count; ++i) {
+            if (is_branch_target[i]) return false;
+        }
+        return true;
+    };
+
+    size_t fused = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        DecodedInstruction& insn = code[i];
+
+        if (insn.op == DecodedOp::Getc && straight_line(i, 4)) {
+            const DecodedInstruction& mov = code[i + 1];
+            const DecodedInstruction& cmp = code[i + 2];
+            const uint8_t a = insn.a;
+            const uint8_t b = mov.a;
+            if (mov.op == DecodedOp::MovVal && b != a &&
+                cmp.op == DecodedOp::CmpReg &&
+                ((cmp.a == a && cmp.b == b) || (cmp.a == b && cmp.b == a)) &&
+                code[i + 3].op == DecodedOp::Jnz) {
+                insn.op = DecodedOp::CheckChar;
+                insn.b = b;
+                insn.imm = mov.imm;
+                ++fused;
+                i += 3;
+                continue;
+            }
+        }
+
+        if (insn.op == DecodedOp::MovVal && straight_line(i, 3)) {
+            const DecodedInstruction& x = code[i + 1];
+            const DecodedInstruction& put = code[i + 2];
+            if (x.op == DecodedOp::XorReg && x.a == insn.a && x.b != insn.a &&
+                put.op == DecodedOp::Putc && put.a == insn.a) {
+                insn.op = DecodedOp::EmitXor;
+                insn.b = x.b;
+                ++fused;
+                i += 2;
+                continue;
+            }
+        }
+    }
+    return fused;
+}
+
+// Executes a program produced by decode_bytecode. Operands were validated by the
+// loader, so handlers neither decode nor bounds-check anything. GETC blocks as
+// with AttachedIo, but PUTC into a stalled sink leaves the VM on that PUTC and
+// returns OutputFull, which is how a MatchSink stops a run early.
+inline VmStatus run_decoded(VirtualMachine& vm, const DecodedProgram& program) {
+    if (vm.ip >= program.source.size()) {
+        vm.registers[0] = 0;
+        return VmStatus::Halted;
+    }
+    if (program.instruction_at[vm.ip] < 0) {
+        // Entering mid-instruction reinterprets the bytes; only the raw loop can do that.
+        return run_vm_switch<HakoniwaVm>(vm, program.source);
+    }
+
+    const DecodedInstruction* const code = program.instructions.data();
+    const DecodedInstruction* insn = code + program.instruction_at[vm.ip];
+    uint64_t retired = vm.instructions;
+
+    // Leaving through insn itself (End) or after it (everything else).
+#define EXIT_AT(insn_ptr) (vm.ip = program.byte_offsets[(insn_ptr) - code], vm.instructions = retired)
+
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+    static void* const dispatch_table[] = {
+        &&op_mov_val, &&op_store, &&op_add, &&op_sub, &&op_xor_reg, &&op_cmp_mem,
+        &&op_cmp_reg, &&op_jnz, &&op_cmp_val, &&op_getc, &&op_putc, &&op_get_tick,
+        &&op_fail, &&op_halt, &&op_invalid, &&op_end, &&op_check_char, &&op_emit_xor,
+    };
+#define CASE(label, decoded_op) label:
+#define NEXT() goto *dispatch_table[static_cast<uint8_t>(insn->op)]
+    NEXT();
+#else
+#define CASE(label, decoded_op) case DecodedOp::decoded_op:
+#define NEXT() continue
+    for (;;) {
+    switch (insn->op) {
+#endif
+
+    CASE(op_mov_val, MovVal) {
+        ++retired;
+        vm.registers[insn->a] = insn->imm;
+        ++insn;
+        NEXT();
+    }
+    CASE(op_store, Store) {
+        ++retired;
+        vm.memory[insn->a] = static_cast<uint8_t>(vm.registers[insn->b]);
+        ++insn;
+        NEXT();
+    }
+    CASE(op_add, Add) {
+        ++retired;
+        vm.registers[insn->a] += vm.registers[insn->b];
+        ++insn;
+        NEXT();
+    }
+    CASE(op_sub, Sub) {
+        ++retired;
+        vm.registers[insn->a] -= vm.registers[insn->b];
+        ++insn;
+        NEXT();
+    }
+    CASE(op_xor_reg, XorReg) {
+        ++retired;
+        vm.registers[insn->a] ^= vm.registers[insn->b];
+        ++insn;
+        NEXT();
+    }
+    CASE(op_cmp_mem, CmpMem) {
+        ++retired;
+        vm.zero_flag = (vm.memory[insn->a] == static_cast<uint8_t>(vm.registers[insn->b]));
+        ++insn;
+        NEXT();
+    }
+    CASE(op_cmp_reg, CmpReg) {
+        ++retired;
+        vm.zero_flag = (vm.registers[insn->a] == vm.registers[insn->b]);
+        ++insn;
+        NEXT();
+    }
+    CASE(op_jnz, Jnz) {
+        ++retired;
+        insn = vm.zero_flag ? insn + 1 : code + insn->imm;
+        NEXT();
+    }
+    CASE(op_cmp_val, CmpVal) {
+        ++retired;
+        vm.zero_flag = !(vm.registers[insn->a] > insn->imm);
+        ++insn;
+        NEXT();
+    }
+    CASE(op_getc, Getc) {
+        ++retired;
+        char c;
+        if (!vm_getc(vm, c)) {
+            EXIT_AT(insn + 1);
+            vm.registers[0] = 0;
+            return VmStatus::Halted;
+        }
+        vm.registers[insn->a] = c;
+        ++insn;
+        NEXT();
+    }
+    CASE(op_putc, Putc) {
+        if (vm.output != nullptr && vm.output->stalled()) {
+            EXIT_AT(insn);
+            return VmStatus::OutputFull;
+        }
+        ++retired;
+        vm_putc(vm, static_cast<char>(vm.registers[insn->a]));
+        ++insn;
+        NEXT();
+    }
+    CASE(op_get_tick, GetTick) {
+        ++retired;
+        vm.instructions = retired;
+        vm.registers[insn->a] = vm_get_tick(vm);
+        ++insn;
+        NEXT();
+    }
+    CASE(op_fail, Fail) {
+        ++retired;
+        EXIT_AT(insn + 1);
+        vm.registers[0] = 1;
+        return VmStatus::Halted;
+    }
+    CASE(op_halt, Halt)
+    CASE(op_invalid, Invalid) {
+        ++retired;
+        EXIT_AT(insn + 1);
+        vm.registers[0] = 0;
+        return VmStatus::Halted;
+    }
+    CASE(op_end, End) {
+        EXIT_AT(insn);
+        vm.registers[0] = 0;
+        return VmStatus::Halted;
+    }
+    CASE(op_check_char, CheckChar) {
+        // GETC a; MOV_VAL b, imm; CMP_REG a, b; JNZ target
+        char c;
+        ++retired;
+        if (!vm_getc(vm, c)) {
+            EXIT_AT(insn + 1);
+            vm.registers[0] = 0;
+            return VmStatus::Halted;
+        }
+        vm.registers[insn->a] = c;
+        vm.registers[insn->b] = insn->imm;
+        vm.zero_flag = (vm.registers[insn->a] == vm.registers[insn->b]);
+        retired += 3;
+        insn = vm.zero_flag ? insn + 4 : code + insn[3].imm;
+        NEXT();
+    }
+    CASE(op_emit_xor, EmitXor) {
+        // MOV_VAL a, imm; XOR_REG a, b; PUTC a
+        if (vm.output != nullptr && vm.output->stalled()) {
+            EXIT_AT(insn);
+            return VmStatus::OutputFull;
+        }
+        retired += 3;
+        vm.registers[insn->a] = insn->imm ^ vm.registers[insn->b];
+        vm_putc(vm, static_cast<char>(vm.registers[insn->a]));
+        insn += 3;
+        NEXT();
+    }
+
+#ifndef MEMORIA_HAS_THREADED_DISPATCH
+    }
+    }
+#endif
+
+#undef CASE
+#undef NEXT
+#undef EXIT_AT
+}
+
+class JitProgram;
+
+#ifdef MEMORIA_HAS_JIT
+// Native code generator for x86-64. VM registers r0-r3 live in r12d-r15d,
+// zero_flag in ebp and the VirtualMachine pointer in rbx; all of them are
+// callee-saved, so calls into the I/O helpers below need no spilling.
+namespace jit {
+
+enum HostReg : uint8_t {
+    RAX = 0, RBX = 3, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+const HostReg vm_reg_to_host[VM_REGISTER_COUNT] = { R12, R13, R14, R15 };
+
+const int32_t REGISTERS_OFFSET = static_cast<int32_t>(offsetof(VirtualMachine, registers));
+const int32_t MEMORY_OFFSET = static_cast<int32_t>(offsetof(VirtualMachine, memory));
+const int32_t IP_OFFSET = static_cast<int32_t>(offsetof(VirtualMachine, ip));
+const int32_t ZERO_FLAG_OFFSET = static_cast<int32_t>(offsetof(VirtualMachine, zero_flag));
+const int32_t INSTRUCTIONS_OFFSET = static_cast<int32_t>(offsetof(VirtualMachine, instructions));
+
+inline int64_t getc_helper(VirtualMachine* vm) {
+    char c;
+    if (!vm_getc(*vm, c)) {
+        return -1;
+    }
+    return static_cast<uint32_t>(c);
+}
+
+inline void putc_helper(VirtualMachine* vm, uint32_t value) {
+    vm_putc(*vm, static_cast<char>(value));
+}
+
+inline uint32_t get_tick_helper(VirtualMachine* vm) {
+    return vm_get_tick(*vm);
+}
+
+class Emitter {
+public:
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b) { code.push_back(b); }
+    void bytes(std::initializer_list<uint8_t> bs) { code.insert(code.end(), bs); }
+    void imm16(uint16_t v) { append(&v, 2); }
+    void imm32(uint32_t v) { append(&v, 4); }
+    void imm64(uint64_t v) { append(&v, 8); }
+
+    void rex(bool w, uint8_t reg, uint8_t rm) {
+        uint8_t prefix = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+        if (prefix != 0x40) byte(prefix);
+    }
+
+    void modrm_reg(uint8_t reg, uint8_t rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+    // [rbx + disp32]
+    void modrm_vm(uint8_t reg, int32_t disp) {
+        byte(0x80 | ((reg & 7) << 3) | RBX);
+        imm32(static_cast<uint32_t>(disp));
+    }
+
+    void mov_reg_imm(HostReg dst, uint32_t value) { rex(false, 0, dst); byte(0xB8 | (dst & 7)); imm32(value); }
+    void alu_reg_reg(uint8_t opcode, HostReg dst, HostReg src) { rex(false, src, dst); byte(opcode); modrm_reg(src, dst); }
+    void mov_reg_reg(HostReg dst, HostReg src) { alu_reg_reg(0x89, dst, src); }
+    void cmp_reg_imm(HostReg dst, uint32_t value) { rex(false, 0, dst); byte(0x81); modrm_reg(7, dst); imm32(value); }
+
+    void load_vm32(HostReg dst, int32_t disp) { rex(false, dst, RBX); byte(0x8B); modrm_vm(dst, disp); }
+    void store_vm32(int32_t disp, HostReg src) { rex(false, src, RBX); byte(0x89); modrm_vm(src, disp); }
+    // Byte forms always carry a REX prefix so that reg 5 means bpl rather than ch.
+    void store_vm8(int32_t disp, HostReg src) { byte(0x40 | ((src & 8) ? 0x04 : 0)); byte(0x88); modrm_vm(src, disp); }
+    void cmp_vm8(int32_t disp, HostReg src) { byte(0x40 | ((src & 8) ? 0x04 : 0)); byte(0x38); modrm_vm(src, disp); }
+    void store_vm16_imm(int32_t disp, uint16_t value) { byte(0x66); byte(0xC7); modrm_vm(0, disp); imm16(value); }
+    void add_vm64_imm(int32_t disp, uint32_t value) { byte(0x48); byte(0x81); modrm_vm(0, disp); imm32(value); }
+
+    // setcc al; movzx ebp, al
+    void set_zero_flag(uint8_t setcc) { bytes({0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xE8}); }
+
+    size_t jcc32(uint8_t cc) { bytes({0x0F, cc}); imm32(0); return code.size() - 4; }
+    size_t jmp32() { byte(0xE9); imm32(0); return code.size() - 4; }
+
+    void patch_rel32(size_t at, size_t target) {
+        int32_t rel = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+        memcpy(&code[at], &rel, 4);
+    }
+
+    void call(const void* fn) {
+        bytes({0x48, 0x89, 0xDF});                  // mov rdi, rbx
+        bytes({0x48, 0xB8});                        // mov rax, imm64
+        imm64(reinterpret_cast<uint64_t>(fn));
+        bytes({0xFF, 0xD0});                        // call rax
+    }
+
+private:
+    void append(const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        code.insert(code.end(), b, b + n);
+    }
+};
+
+} // namespace jit
+
+class JitProgram {
+public:
+    JitProgram() = default;
+    JitProgram(const JitProgram&) = delete;
+    JitProgram& operator=(const JitProgram&) = delete;
+    ~JitProgram() { release(); }
+
+    bool compile(const DecodedProgram& program);
+    void run(VirtualMachine& vm, const DecodedProgram& program) const;
+
+private:
+    using EntryFn = void (*)(VirtualMachine*, const void*);
+
+    void release() {
+        if (code_ != nullptr) {
+            munmap(code_, code_size_);
+            code_ = nullptr;
+        }
+    }
+
+    void* code_ = nullptr;
+    size_t code_size_ = 0;
+    std::vector<uint32_t> instruction_entry_;
+    std::vector<uint32_t> instruction_entry_adjust_;
+};
+
+inline bool JitProgram::compile(const DecodedProgram& program) {
+    using namespace jit;
+    release();
+
+    const auto& instructions = program.instructions;
+    std::vector<bool> is_branch_target(instructions.size(), false);
+    for (const auto& insn : instructions) {
+        if (insn.op == DecodedOp::Jnz) {
+            is_branch_target[insn.imm] = true;
+        }
+    }
+
+    Emitter e;
+
+    // Prologue: save callee-saved registers, keep the stack 16-byte aligned
+    // for helper calls, load VM state and jump to the requested instruction.
+    e.bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+    e.bytes({0x48, 0x83, 0xEC, 0x08});              // sub rsp, 8
+    e.bytes({0x48, 0x89, 0xFB});                    // mov rbx, rdi
+    for (int r = 0; r < VM_REGISTER_COUNT; ++r) {
+        e.load_vm32(vm_reg_to_host[r], REGISTERS_OFFSET + 4 * r);
+    }
+    e.bytes({0x0F, 0xB6});                          // movzx ebp, byte [rbx + zero_flag]
+    e.modrm_vm(RBP, ZERO_FLAG_OFFSET);
+    e.bytes({0xFF, 0xE6});                          // jmp rsi
+
+    // Epilogue: write VM state back and return to run().
+    const size_t epilogue = e.code.size();
+    for (int r = 0; r < VM_REGISTER_COUNT; ++r) {
+        e.store_vm32(REGISTERS_OFFSET + 4 * r, vm_reg_to_host[r]);
+    }
+    e.store_vm8(ZERO_FLAG_OFFSET, RBP);
+    e.bytes({0x48, 0x83, 0xC4, 0x08});              // add rsp, 8
+    e.bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});
+
+    auto emit_exit = [&](uint16_t ip, uint32_t r0) {
+        e.store_vm16_imm(IP_OFFSET, ip);
+        e.mov_reg_imm(R12, r0);
+        e.patch_rel32(e.jmp32(), epilogue);
+    };
+
+    // A JNZ straight after a compare can branch on the host flags that the
+    // compare left behind, unless another JNZ can land on it.
+    std::vector<bool> uses_host_flags(instructions.size(), false);
+    // Basic-block leaders; vm.instructions is bumped once per block instead
+    // of once per instruction.
+    std::vector<bool> is_leader(instructions.size(), false);
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        const DecodedOp op = instructions[i].op;
+        const DecodedOp prev = (i > 0) ? instructions[i - 1].op : DecodedOp::End;
+        if (op == DecodedOp::Jnz && i > 0 && !is_branch_target[i]) {
+            uses_host_flags[i] = (prev == DecodedOp::CmpMem || prev == DecodedOp::CmpReg || prev == DecodedOp::CmpVal);
+        }
+        is_leader[i] = (i == 0) || is_branch_target[i] || op == DecodedOp::End ||
+                       prev == DecodedOp::Jnz || prev == DecodedOp::Fail || prev == DecodedOp::Halt ||
+                       prev == DecodedOp::Invalid || prev == DecodedOp::End;
+    }
+
+    uint32_t pending = 0;
+    auto flush_retired = [&]() {
+        if (pending > 0) {
+            e.add_vm64_imm(INSTRUCTIONS_OFFSET, pending);
+            pending = 0;
+        }
+    };
+
+    std::vector<uint32_t> entry(instructions.size());
+    std::vector<uint32_t> entry_adjust(instructions.size(), 0);
+    std::vector<std::pair<size_t, uint32_t>> branch_fixups;
+    size_t block_start = 0;
+
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        const DecodedInstruction& insn = instructions[i];
+        if (is_leader[i]) {
+            flush_retired();
+            block_start = i;
+        }
+        entry[i] = static_cast<uint32_t>(e.code.size());
+        // Entering mid-block must not count the block's earlier instructions.
+        entry_adjust[i] = static_cast<uint32_t>(i - block_start);
+        const uint16_t next_ip = (i + 1 < program.byte_offsets.size()) ? program.byte_offsets[i + 1] : 0;
+
+        if (insn.op != DecodedOp::End && !uses_host_flags[i]) {
+            ++pending;
+        }
+        if (i + 1 < instructions.size() && uses_host_flags[i + 1]) {
+            // The add below clobbers flags, so settle the count for the compare
+            // and its JNZ before emitting the compare.
+            ++pending;
+            flush_retired();
+        }
+
+        // A superinstruction's first slot still describes its first original
+        // instruction and the rest follow unchanged, so the JIT compiles
+        // fused programs one original instruction at a time.
+        switch (insn.op) {
+            case DecodedOp::MovVal:
+            case DecodedOp::EmitXor:
+                e.mov_reg_imm(vm_reg_to_host[insn.a], insn.imm);
+                break;
+            case DecodedOp::Store:
+                e.store_vm8(MEMORY_OFFSET + insn.a, vm_reg_to_host[insn.b]);
+                break;
+            case DecodedOp::Add:
+                e.alu_reg_reg(0x01, vm_reg_to_host[insn.a], vm_reg_to_host[insn.b]);
+                break;
+            case DecodedOp::Sub:
+                e.alu_reg_reg(0x29, vm_reg_to_host[insn.a], vm_reg_to_host[insn.b]);
+                break;
+            case DecodedOp::XorReg:
+                e.alu_reg_reg(0x31, vm_reg_to_host[insn.a], vm_reg_to_host[insn.b]);
+                break;
+            case DecodedOp::CmpMem:
+                e.cmp_vm8(MEMORY_OFFSET + insn.a, vm_reg_to_host[insn.b]);
+                e.set_zero_flag(0x94);              // sete
+                break;
+            case DecodedOp::CmpReg:
+                e.alu_reg_reg(0x39, vm_reg_to_host[insn.a], vm_reg_to_host[insn.b]);
+                e.set_zero_flag(0x94);              // sete
+                break;
+            case DecodedOp::CmpVal:
+                e.cmp_reg_imm(vm_reg_to_host[insn.a], insn.imm);
+                e.set_zero_flag(0x96);              // setbe
+                break;
+            case DecodedOp::Jnz: {
+                uint8_t cc = 0x84;                  // jz on ebp
+                if (uses_host_flags[i]) {
+                    cc = (instructions[i - 1].op == DecodedOp::CmpVal) ? 0x87 : 0x85;   // ja / jne
+                } else {
+                    flush_retired();
+                    e.bytes({0x85, 0xED});          // test ebp, ebp
+                }
+                branch_fixups.emplace_back(e.jcc32(cc), insn.imm);
+                break;
+            }
+            case DecodedOp::Getc:
+            case DecodedOp::CheckChar: {
+                e.call(reinterpret_cast<const void*>(&getc_helper));
+                e.bytes({0x48, 0x85, 0xC0});        // test rax, rax
+                size_t eof = e.jcc32(0x88);         // js
+                e.mov_reg_reg(vm_reg_to_host[insn.a], RAX);
+                size_t skip = e.jmp32();
+                e.patch_rel32(eof, e.code.size());
+                if (pending > 0) {
+                    e.add_vm64_imm(INSTRUCTIONS_OFFSET, pending);
+                }
+                emit_exit(next_ip, 0);
+                e.patch_rel32(skip, e.code.size());
+                break;
+            }
+            case DecodedOp::Putc:
+                e.mov_reg_reg(RSI, vm_reg_to_host[insn.a]);
+                e.call(reinterpret_cast<const void*>(&putc_helper));
+                break;
+            case DecodedOp::GetTick:
+                // Clocks may read vm.instructions, so settle the count here
+                // and count later entries into this block from the next slot.
+                flush_retired();
+                block_start = i + 1;
+                e.call(reinterpret_cast<const void*>(&get_tick_helper));
+                e.mov_reg_reg(vm_reg_to_host[insn.a], RAX);
+                break;
+            case DecodedOp::Fail:
+                flush_retired();
+                emit_exit(next_ip, 1);
+                break;
+            case DecodedOp::Halt:
+            case DecodedOp::Invalid:
+                flush_retired();
+                emit_exit(next_ip, 0);
+                break;
+            case DecodedOp::End:
+                flush_retired();
+                emit_exit(program.byte_offsets[i], 0);
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // Entering the program directly at a flag-fused JNZ would see stale host
+    // flags, so such entries go through a stub that tests ebp instead. Its
+    // count was settled at the compare, so the stub counts it itself.
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        if (!uses_host_flags[i]) continue;
+        entry[i] = static_cast<uint32_t>(e.code.size());
+        entry_adjust[i] = 0;
+        e.add_vm64_imm(INSTRUCTIONS_OFFSET, 1);
+        e.bytes({0x85, 0xED});                      // test ebp, ebp
+        branch_fixups.emplace_back(e.jcc32(0x84), instructions[i].imm);
+        e.patch_rel32(e.jmp32(), entry[i + 1]);
+    }
+
+    for (const auto& fixup : branch_fixups) {
+        e.patch_rel32(fixup.first, entry[fixup.second]);
+    }
+
+    void* memory = mmap(nullptr, e.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    memcpy(memory, e.code.data(), e.code.size());
+    if (mprotect(memory, e.code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, e.code.size());
+        return false;
+    }
+
+    code_ = memory;
+    code_size_ = e.code.size();
+    instruction_entry_ = std::move(entry);
+    instruction_entry_adjust_ = std::move(entry_adjust);
+    return true;
+}
+
+inline void JitProgram::run(VirtualMachine& vm, const DecodedProgram& program) const {
+    if (vm.ip >= program.source.size()) {
+        vm.registers[0] = 0;
+        return;
+    }
+    if (code_ == nullptr || program.instruction_at[vm.ip] < 0) {
+        run_decoded(vm, program);
+        return;
+    }
+    const size_t index = program.instruction_at[vm.ip];
+    const uint8_t* base = static_cast<const uint8_t*>(code_);
+    EntryFn fn = reinterpret_cast<EntryFn>(code_);
+    vm.instructions -= instruction_entry_adjust_[index];
+    fn(&vm, base + instruction_entry_[index]);
+}
+#endif
+
+inline void run_vm(VirtualMachine& vm, BytecodeView bytecode, DispatchMode mode = default_dispatch_mode) {
+    if (mode == DispatchMode::Decoded) {
+        DecodedProgram program;
+        std::string error;
+        if (!decode_bytecode(bytecode, program, error)) {
+            std::cerr << "bytecode rejected: " << error << std::endl;
+            vm.registers[0] = 0;
+            return;
+        }
+        fuse_superinstructions(program);
+        run_decoded(vm, program);
+        return;
+    }
+    if (mode == DispatchMode::Jit) {
+        DecodedProgram program;
+        std::string error;
+        if (!decode_bytecode(bytecode, program, error)) {
+            std::cerr << "bytecode rejected: " << error << std::endl;
+            vm.registers[0] = 0;
+            return;
+        }
+#ifdef MEMORIA_HAS_JIT
+        JitProgram jit_program;
+        if (jit_program.compile(program)) {
+            jit_program.run(vm, program);
+            return;
+        }
+#endif
+        run_decoded(vm, program);
+        return;
+    }
+    run_vm<HakoniwaVm>(vm, bytecode, mode);
+}
+
+// A Hakoniwa VM that can be left waiting for a human. resume() runs until
+// GETC has nothing to read, PUTC has nowhere to write or the program stops,
+// and returns which; the caller feeds or drains and resumes it whenever it
+// likes. All that stays resident between resumes is the machine state, the
+// unread input and the undrained output, a few hundred bytes, so one thread
+// can keep tens of thousands of them waiting. The bytecode is only borrowed.
+// The VM points at its own input and output, so a ResumableVm can be
+// neither copied nor moved: keep many of them in a std::deque.
+// Decoded and Jit run the switch interpreter here: both read and write
+// straight through vm_getc/vm_putc and have no way to suspend. For a run
+// as short as one keystroke the switch and threaded loops cost the same.
+class ResumableVm {
+public:
+    explicit ResumableVm(BytecodeView bytecode, size_t output_capacity = 64, DispatchMode mode = default_dispatch_mode)
+        : bytecode_(bytecode), output_(output_capacity), mode_(mode) {
+        vm_.input = &input_;
+        vm_.output = &output_;
+    }
+
+    VmStatus resume() {
+        if (status_ == VmStatus::Halted && started_) {
+            return status_;
+        }
+        started_ = true;
+        status_ = run_vm<ResumableHakoniwaVm>(vm_, bytecode_, mode_);
+        return status_;
+    }
+
+    void feed(std::string_view bytes) { input_.feed(bytes); }
+    void close_input() { input_.close(); }
+    std::string_view output() const { return output_.view(); }
+    void drain() { output_.drain(); }
+
+    VmStatus status() const { return status_; }
+    bool halted() const { return started_ && status_ == VmStatus::Halted; }
+    VirtualMachine& vm() { return vm_; }
+    const VirtualMachine& vm() const { return vm_; }
+
+private:
+    VirtualMachine vm_;
+    BytecodeView bytecode_;
+    FeedInput input_;
+    DrainSink output_;
+    DispatchMode mode_;
+    VmStatus status_ = VmStatus::Halted;
+    bool started_ = false;
+};
+
+
+// Thread pool that splits an index range across per-worker deques. Owners
+// take work from the back of their own deque; idle workers steal the front
+// half of someone else's range, so uneven run times even out.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned thread_count = 0) {
+        if (thread_count == 0) {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < thread_count; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (unsigned i = 0; i < thread_count; ++i) {
+            threads_.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    size_t thread_count() const { return threads_.size(); }
+
+    // Calls fn(begin, end) over disjoint chunks of at most `grain` indices
+    // covering [0, count), and returns once every chunk has finished.
+    void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+        if (count == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_ = &fn;
+        grain_ = std::max<size_t>(grain, 1);
+        remaining_.store(count);
+
+        const size_t slice = (count + workers_.size() - 1) / workers_.size();
+        for (size_t w = 0, begin = 0; w < workers_.size() && begin < count; ++w, begin += slice) {
+            std::lock_guard<std::mutex> worker_lock(workers_[w]->mutex);
+            workers_[w]->ranges.push_back(Range{begin, std::min(count, begin + slice)});
+        }
+
+        ++generation_;
+        wake_.notify_all();
+        // Also wait for every worker to leave its loop, so none of them can
+        // pick up the next batch's ranges with this batch's job.
+        done_.wait(lock, [this] { return remaining_.load() == 0 && active_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    bool pop_local(size_t self, Range& out) {
+        Worker& w = *workers_[self];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.ranges.empty()) {
+            return false;
+        }
+        Range& back = w.ranges.back();
+        if (back.end - back.begin > grain_) {
+            out = Range{back.end - grain_, back.end};
+            back.end -= grain_;
+        } else {
+            out = back;
+            w.ranges.pop_back();
+        }
+        return true;
+    }
+
+    // Moves the front half of another worker's oldest range into our own deque.
+    bool steal(size_t self) {
+        for (size_t k = 1; k < workers_.size(); ++k) {
+            Worker& victim = *workers_[(self + k) % workers_.size()];
+            Range taken;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.ranges.empty()) {
+                    continue;
+                }
+                Range& front = victim.ranges.front();
+                const size_t size = front.end - front.begin;
+                if (size > grain_) {
+                    const size_t half = std::max(grain_, size / 2);
+                    taken = Range{front.begin, front.begin + half};
+                    front.begin += half;
+                } else {
+                    taken = front;
+                    victim.ranges.pop_front();
+                }
+            }
+            std::lock_guard<std::mutex> lock(workers_[self]->mutex);
+            workers_[self]->ranges.push_back(taken);
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(size_t self) {
+        uint64_t seen_generation = 0;
+        for (;;) {
+            const std::function<void(size_t, size_t)>* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+                if (stopping_) {
+                    return;
+                }
+                seen_generation = generation_;
+                job = job_;
+                ++active_;
+            }
+
+            // Chunks are only ever split, never added, while a batch runs, so
+            // once nothing is left to pop or steal this worker is done.
+            Range r;
+            while (pop_local(self, r) || (steal(self) && pop_local(self, r))) {
+                (*job)(r.begin, r.end);
+                remaining_.fetch_sub(r.end - r.begin);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--active_ == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(size_t, size_t)>* job_ = nullptr;
+    size_t grain_ = 1;
+    std::atomic<size_t> remaining_{0};
+    size_t active_ = 0;
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+};
+
+struct BatchResult {
+    uint32_t exit_status = 0;   // registers[0] when the VM stopped
+    std::string output;
+    uint64_t instructions = 0;
+    // With stop patterns: the first one the output matched, or -1, and
+    // whether that stopped the VM before it halted. No output is kept.
+    int matched = -1;
+    bool stopped = false;
+};
+
+#ifdef MEMORIA_HAS_LOCKSTEP
+// 8 x 32-bit lanes. GCC/Clang lower arithmetic, compares and ?: on these
+// to single AVX2 instructions with -mavx2, and to SSE2 pairs otherwise.
+typedef uint32_t lane_u32x8 __attribute__((vector_size(32)));
+typedef int32_t lane_i32x8 __attribute__((vector_size(32)));
+
+// A macro rather than a function: passing vectors by value across a call
+// boundary changes ABI depending on whether AVX is enabled.
+#define LANE_SPLAT(value) (lane_u32x8{} + static_cast<uint32_t>(value))
+
+// Runs many VM contexts over one program in structure-of-arrays form.
+// Each step executes the instruction at the lowest pc among live lanes for
+// every lane parked there; register arithmetic, compares, JNZ and pc
+// updates are vector ops under that lane mask, while memory and I/O are
+// done per lane. Lanes whose JNZ went the other way simply wait until the
+// minimum pc reaches them, and a lane that stops is refilled with the
+// next pending input, so contexts keep regrouping by pc.
+template <size_t Lanes = 16>
+class LockstepGroup {
+    static_assert(Lanes % 8 == 0, "lanes come in blocks of eight");
+    static constexpr size_t VECTORS = Lanes / 8;
+    static constexpr uint32_t DEAD = 0xFFFFFFFF;
+
+public:
+    // GET_TICK source for every lane; null reads steady_clock once per step.
+    void set_clock(const TickClock* clock) { clock_ = clock; }
+
+    // Runs inputs[begin, end) to completion and writes results[begin, end).
+    void run(const DecodedProgram& program, const std::vector<std::string_view>& inputs,
+             size_t begin, size_t end, BatchResult* results) {
+        if (program.source.empty()) {
+            for (size_t i = begin; i < end; ++i) {
+                results[i] = BatchResult();
+            }
+            return;
+        }
+
+        const DecodedInstruction* const code = program.instructions.data();
+        next_input_ = begin;
+        end_input_ = end;
+        live_ = 0;
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            pc(lane) = DEAD;
+            start_lane(lane, inputs);
+        }
+
+        uint32_t steps = 0;
+        while (live_ > 0) {
+            lane_u32x8 low = pc_[0];
+            for (size_t v = 1; v < VECTORS; ++v) {
+                low = (pc_[v] < low) ? pc_[v] : low;
+            }
+            uint32_t current = low[0];
+            for (int k = 1; k < 8; ++k) {
+                current = (low[k] < current) ? low[k] : current;
+            }
+
+            const DecodedInstruction& insn = code[current];
+            const lane_u32x8 here = LANE_SPLAT(current);
+            const lane_u32x8 next = LANE_SPLAT(current + 1);
+            lane_i32x8 mask[VECTORS];
+            for (size_t v = 0; v < VECTORS; ++v) {
+                mask[v] = (pc_[v] == here);
+            }
+
+            // As in the JIT, a fused slot is executed as its first original instruction.
+            switch (insn.op) {
+                case DecodedOp::MovVal:
+                case DecodedOp::EmitXor: {
+                    const lane_u32x8 imm = LANE_SPLAT(insn.imm);
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        regs_[insn.a][v] = mask[v] ? imm : regs_[insn.a][v];
+                    }
+                    advance(mask, next);
+                    break;
+                }
+                case DecodedOp::Add:
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        regs_[insn.a][v] = mask[v] ? regs_[insn.a][v] + regs_[insn.b][v] : regs_[insn.a][v];
+                    }
+                    advance(mask, next);
+                    break;
+                case DecodedOp::Sub:
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        regs_[insn.a][v] = mask[v] ? regs_[insn.a][v] - regs_[insn.b][v] : regs_[insn.a][v];
+                    }
+                    advance(mask, next);
+                    break;
+                case DecodedOp::XorReg:
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        regs_[insn.a][v] = mask[v] ? regs_[insn.a][v] ^ regs_[insn.b][v] : regs_[insn.a][v];
+                    }
+                    advance(mask, next);
+                    break;
+                case DecodedOp::CmpReg:
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        zf_[v] = mask[v] ? (regs_[insn.a][v] == regs_[insn.b][v]) : zf_[v];
+                    }
+                    advance(mask, next);
+                    break;
+                case DecodedOp::CmpVal: {
+                    const lane_u32x8 imm = LANE_SPLAT(insn.imm);
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        zf_[v] = mask[v] ? (regs_[insn.a][v] <= imm) : zf_[v];
+                    }
+                    advance(mask, next);
+                    break;
+                }
+                case DecodedOp::Jnz: {
+                    const lane_u32x8 target = LANE_SPLAT(insn.imm);
+                    for (size_t v = 0; v < VECTORS; ++v) {
+                        pc_[v] = mask[v] ? (zf_[v] ? next : target) : pc_[v];
+                        retired_[v] -= (lane_u32x8)mask[v];
+                    }
+                    break;
+                }
+                case DecodedOp::GetTick: {
+                    if (clock_ != nullptr) {
+                        // Per lane: each one has its own retired count.
+                        for (size_t lane = 0; lane < Lanes; ++lane) {
+                            if (mask[lane / 8][lane % 8]) {
+                                reg(insn.a, lane) = clock_->now_ms(retired_wide_[lane] + retired(lane) + 1);
+                            }
+                        }
+                    } else {
+                        const lane_u32x8 tick = LANE_SPLAT(steady_clock_ms());
+                        for (size_t v = 0; v < VECTORS; ++v) {
+                            regs_[insn.a][v] = mask[v] ? tick : regs_[insn.a][v];
+                        }
+                    }
+                    advance(mask, next);
+                    break;
+                }
+                default:
+                    step_scalar(insn, current, mask, results);
+                    break;
+            }
+
+            for (size_t lane : finished_) {
+                start_lane(lane, inputs);
+            }
+            finished_.clear();
+
+            // Per-lane counters are 32-bit; fold them into 64-bit totals long
+            // before any of them can wrap.
+            if (++steps == (1u << 31)) {
+                for (size_t lane = 0; lane < Lanes; ++lane) {
+                    retired_wide_[lane] += retired(lane);
+                    retired(lane) = 0;
+                }
+                steps = 0;
+            }
+        }
+    }
+
+private:
+    uint32_t& pc(size_t lane) { return pc_[lane / 8][lane % 8]; }
+    uint32_t& reg(size_t r, size_t lane) { return regs_[r][lane / 8][lane % 8]; }
+    uint32_t& retired(size_t lane) { return retired_[lane / 8][lane % 8]; }
+    bool zero_flag(size_t lane) const { return zf_[lane / 8][lane % 8] != 0; }
+    void set_zero_flag(size_t lane, bool value) { zf_[lane / 8][lane % 8] = value ? -1 : 0; }
+
+    void advance(const lane_i32x8* mask, const lane_u32x8& next) {
+        for (size_t v = 0; v < VECTORS; ++v) {
+            pc_[v] = mask[v] ? next : pc_[v];
+            retired_[v] -= (lane_u32x8)mask[v];
+        }
+    }
+
+    void start_lane(size_t lane, const std::vector<std::string_view>& inputs) {
+        if (next_input_ >= end_input_) {
+            return;
+        }
+        input_index_[lane] = next_input_;
+        in_[lane].reset(inputs[next_input_]);
+        out_[lane].clear();
+        ++next_input_;
+        ++live_;
+
+        for (size_t r = 0; r < VM_REGISTER_COUNT; ++r) {
+            reg(r, lane) = 0;
+        }
+        set_zero_flag(lane, false);
+        pc(lane) = 0;
+        retired(lane) = 0;
+        retired_wide_[lane] = 0;
+        memset(memory_[lane], 0, sizeof(memory_[lane]));
+    }
+
+    void finish_lane(size_t lane, uint32_t exit_status, BatchResult* results) {
+        BatchResult& result = results[input_index_[lane]];
+        result.exit_status = exit_status;
+        result.output.assign(out_[lane].view());
+        result.instructions = retired_wide_[lane] + retired(lane);
+        pc(lane) = DEAD;
+        --live_;
+        finished_.push_back(lane);
+    }
+
+    void step_scalar(const DecodedInstruction& insn, uint32_t current, const lane_i32x8* mask, BatchResult* results) {
+        for (size_t lane = 0; lane < Lanes; ++lane) {
+            if (!mask[lane / 8][lane % 8]) {
+                continue;
+            }
+            if (insn.op != DecodedOp::End) {
+                ++retired(lane);
+            }
+            switch (insn.op) {
+                case DecodedOp::Store:
+                    memory_[lane][insn.a] = static_cast<uint8_t>(reg(insn.b, lane));
+                    break;
+                case DecodedOp::CmpMem:
+                    set_zero_flag(lane, memory_[lane][insn.a] == static_cast<uint8_t>(reg(insn.b, lane)));
+                    break;
+                case DecodedOp::Getc:
+                case DecodedOp::CheckChar: {
+                    char c;
+                    if (!in_[lane].get(c)) {
+                        finish_lane(lane, 0, results);
+                        continue;
+                    }
+                    reg(insn.a, lane) = c;
+                    break;
+                }
+                case DecodedOp::Putc:
+                    out_[lane].put(static_cast<char>(reg(insn.a, lane)));
+                    break;
+                case DecodedOp::Fail:
+                    finish_lane(lane, 1, results);
+                    continue;
+                default:
+                    // Halt, Invalid and End all stop the VM with r0 = 0.
+                    finish_lane(lane, 0, results);
+                    continue;
+            }
+            pc(lane) = current + 1;
+        }
+    }
+
+    lane_u32x8 regs_[VM_REGISTER_COUNT][VECTORS];
+    lane_i32x8 zf_[VECTORS];
+    lane_u32x8 pc_[VECTORS];
+    lane_u32x8 retired_[VECTORS];
+    uint64_t retired_wide_[Lanes];
+    uint8_t memory_[Lanes][256];
+    size_t input_index_[Lanes];
+    SpanInput in_[Lanes];
+    ArenaSink out_[Lanes];
+    std::vector<size_t> finished_;
+    size_t next_input_ = 0;
+    size_t end_input_ = 0;
+    size_t live_ = 0;
+    const TickClock* clock_ = nullptr;
+};
+#endif
+
+// Runs one VirtualMachine per input over a shared, read-only program.
+class BatchExecutor {
+public:
+    explicit BatchExecutor(unsigned thread_count = 0) : pool_(thread_count) {}
+
+    size_t thread_count() const { return pool_.thread_count(); }
+
+    // Attached to every VM the executor runs; null means steady_clock.
+    void set_clock(const TickClock* clock) { clock_ = clock; }
+
+    // `jit` may be null; when given it must have been compiled from `program`.
+    std::vector<BatchResult> run(const DecodedProgram& program, const std::vector<std::string_view>& inputs,
+                                 const JitProgram* jit = nullptr, size_t grain = 16) {
+        std::vector<BatchResult> results(inputs.size());
+        pool_.parallel_for(inputs.size(), grain, [&](size_t begin, size_t end) {
+            ArenaSink output;
+            for (size_t i = begin; i < end; ++i) {
+                SpanInput input(inputs[i]);
+                output.clear();
+
+                VirtualMachine vm;
+                vm.input = &input;
+                vm.output = &output;
+                vm.clock = clock_;
+#ifdef MEMORIA_HAS_JIT
+                if (jit != nullptr) {
+                    jit->run(vm, program);
+                } else
+#endif
+                {
+                    run_decoded(vm, program);
+                }
+
+                results[i].exit_status = vm.registers[0];
+                results[i].output.assign(output.view());
+                results[i].instructions = vm.instructions;
+            }
+        });
+        return results;
+    }
+
+    // Runs every input only until its output matches one of `stop`: the
+    // output streams through a MatchSink instead of being collected, and a
+    // VM is abandoned as soon as the verdict is in. Results carry the
+    // pattern that matched; exit_status is only meaningful when the VM was
+    // not stopped. A VM stops at most `window` PUTCs after the match.
+    std::vector<BatchResult> run_until(const DecodedProgram& program, const std::vector<std::string_view>& inputs,
+                                       const PatternSet& stop, size_t window = 16, size_t grain = 16) {
+        std::vector<BatchResult> results(inputs.size());
+        pool_.parallel_for(inputs.size(), grain, [&](size_t begin, size_t end) {
+            MatchSink output(stop, nullptr, true, window);
+            for (size_t i = begin; i < end; ++i) {
+                SpanInput input(inputs[i]);
+                output.reset();
+
+                VirtualMachine vm;
+                vm.input = &input;
+                vm.output = &output;
+                vm.clock = clock_;
+                const bool halted = run_decoded(vm, program) == VmStatus::Halted;
+                if (halted) {
+                    output.flush();
+                }
+
+                results[i].exit_status = vm.registers[0];
+                results[i].instructions = vm.instructions;
+                results[i].matched = output.first_match();
+                results[i].stopped = !halted;
+            }
+        });
+        return results;
+    }
+
+#ifdef MEMORIA_HAS_LOCKSTEP
+    // Same results as run(), but every worker executes its chunk of inputs
+    // as one SIMD LockstepGroup instead of one VM at a time.
+    std::vector<BatchResult> run_lockstep(const DecodedProgram& program, const std::vector<std::string_view>& inputs,
+                                          size_t grain = 256) {
+        std::vector<BatchResult> results(inputs.size());
+        pool_.parallel_for(inputs.size(), grain, [&](size_t begin, size_t end) {
+            LockstepGroup<16> group;
+            group.set_clock(clock_);
+            group.run(program, inputs, begin, end, results.data());
+        });
+        return results;
+    }
+#endif
+
+private:
+    const TickClock* clock_ = nullptr;
+    WorkStealingPool pool_;
+};
+
+// Runs one program over many inputs, re-using the execution that inputs with
+// a common prefix share. Inputs are visited in sorted order; every GETC of
+// the current run leaves a checkpoint, and the next input resumes from the
+// checkpoint for the deepest byte it shares with the previous one instead
+// of starting over. Results match running each input from scratch as long
+// as the program is deterministic: it must not read GET_TICK, or must read
+// it from a clock that only depends on the instruction count.
+class PrefixExplorer {
+public:
+    // bytecode must outlive the explorer.
+    explicit PrefixExplorer(BytecodeView bytecode) : bytecode_(bytecode) {}
+
+    void set_clock(const TickClock* clock) { clock_ = clock; }
+
+    std::vector<BatchResult> run(const std::vector<std::string_view>& inputs) {
+        std::vector<size_t> order(inputs.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return inputs[a] < inputs[b]; });
+
+        std::vector<BatchResult> results(inputs.size());
+        checkpoints_.clear();
+        executed_ = 0;
+        std::string_view previous;
+        for (size_t index : order) {
+            const std::string_view input = inputs[index];
+            VirtualMachine vm;
+            input_.reset(input, 0);
+            vm.input = &input_;
+            vm.output = &output_;
+            vm.clock = clock_;
+            current_vm_ = &vm;
+
+            if (checkpoints_.empty()) {
+                output_.clear();
+                run_vm_switch<HakoniwaVm>(vm, bytecode_);
+                executed_ += vm.instructions;
+            } else {
+                resume(vm, input, std::min(common_prefix(previous, input), checkpoints_.size() - 1));
+            }
+
+            results[index].exit_status = vm.registers[0];
+            results[index].output.assign(output_.view());
+            results[index].instructions = vm.instructions;
+            previous = input;
+        }
+        return results;
+    }
+
+    // Instructions actually executed by the last run(); the sum of the
+    // results' instruction counts is what running every input from scratch
+    // would have cost.
+    uint64_t executed_instructions() const { return executed_; }
+
+private:
+    // Hands out one byte per underflow(), so the explorer sees every GETC
+    // before it is answered and can checkpoint the VM there.
+    class TapInput : public InputSource {
+    public:
+        explicit TapInput(PrefixExplorer& owner) : owner_(owner) {}
+
+        void reset(std::string_view data, size_t offset) {
+            data_ = data;
+            offset_ = offset;
+            cursor_ = limit_ = nullptr;
+        }
+
+        size_t offset() const { return offset_; }
+
+    protected:
+        bool underflow() override {
+            owner_.on_getc(offset_);
+            if (offset_ >= data_.size()) {
+                return false;
+            }
+            cursor_ = data_.data() + offset_;
+            limit_ = cursor_ + 1;
+            ++offset_;
+            return true;
+        }
+
+    private:
+        PrefixExplorer& owner_;
+        std::string_view data_;
+        size_t offset_ = 0;
+    };
+
+    struct GetcCheckpoint {
+        VmCheckpoint state;
+        uint8_t reg = 0;   // destination of the pending GETC
+    };
+
+    static size_t common_prefix(std::string_view a, std::string_view b) {
+        const size_t limit = std::min(a.size(), b.size());
+        size_t n = 0;
+        while (n < limit && a[n] == b[n]) {
+            ++n;
+        }
+        return n;
+    }
+
+    // The VM is inside the GETC for byte `offset`: vm.ip is already past the
+    // instruction and nothing has been written yet.
+    void on_getc(size_t offset) {
+        if (offset < checkpoints_.size()) {
+            return;
+        }
+        GetcCheckpoint checkpoint;
+        checkpoint.state.capture(*current_vm_, offset, output_.size());
+        checkpoint.reg = bytecode_[current_vm_->ip - 1];
+        checkpoints_.push_back(checkpoint);
+    }
+
+    // Restores the GETC waiting for byte `depth`, answers it from `input`
+    // and runs the rest of the program.
+    void resume(VirtualMachine& vm, std::string_view input, size_t depth) {
+        checkpoints_.resize(depth + 1);
+        const GetcCheckpoint& checkpoint = checkpoints_[depth];
+        checkpoint.state.restore(vm);
+        output_.truncate(checkpoint.state.output_size);
+        const uint64_t resumed_at = vm.instructions;
+
+        if (depth >= input.size()) {
+            ResultHalt::stop(vm, 0);
+            return;
+        }
+        vm.registers[checkpoint.reg] = input[depth];
+        input_.reset(input, depth + 1);
+        run_vm_switch<HakoniwaVm>(vm, bytecode_);
+        executed_ += vm.instructions - resumed_at;
+    }
+
+    BytecodeView bytecode_;
+    std::vector<GetcCheckpoint> checkpoints_;   // [k]: the GETC for byte k of the current input
+    TapInput input_{*this};
+    ArenaSink output_;
+    VirtualMachine* current_vm_ = nullptr;
+    const TickClock* clock_ = nullptr;
+    uint64_t executed_ = 0;
+};
@@ -0,0 +1,238 @@
+// Client stand-in for load testing a project_memoria --listen server.
+//
+// Build next to the game:
+//   g++ -std=c++17 -O2 -pthread -o memoria_client memoria_client.cpp
+//
+// Usage: memoria_client --connect=<address> [--clients=N] [--script=<file>]
+//                       [--expect=<text>] [--echo]
+//
+// Opens N connections at once and plays every one of them on a single
+// epoll loop. Each client answers a prompt ("> " after a choice, or the
+// password prompt) with the next line of the script, the way a player
+// would after reading the screen; the default script answers B to every
+// choice and then enters the password. A client is done when the server
+// closes its connection, and it passes if --expect (default "bsctf")
+// appeared in what it received. --echo copies the first client's stream
+// to stdout. The summary goes to stderr; the exit status is 0 only if
+// every client passed.
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+
+#include "memoria_server.hpp"
+#include "memoria_match.hpp"
+
+#ifndef MEMORIA_HAS_SERVER
+int main() {
+    std::cerr << "memoria_client needs Linux" << std::endl;
+    return 2;
+}
+#else
+
+// What the game prints when it waits for a line.
+const std::string_view PROMPTS[] = {"\n> ", "Password: "};
+
+struct Client {
+    int fd = -1;
+    size_t next_line = 0;
+    uint32_t match_state = PatternSet::start();   // carried across reads
+    bool passed = false;
+    bool done = false;
+    uint64_t received = 0;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+class LoadClient {
+public:
+    LoadClient(std::vector<std::string> lines, std::string expect, bool echo)
+        : lines_(std::move(lines)), expect_(std::move(expect)), echo_(echo) {
+        // The prompts come first, so a pattern index below std::size(PROMPTS) is a prompt.
+        for (std::string_view prompt : PROMPTS) {
+            markers_.add(prompt);
+        }
+        markers_.add(expect_);
+        markers_.compile();
+    }
+
+    int run(const std::string& address, size_t count) {
+        const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        clients_.resize(count);
+        open_ = count;
+        size_t failed = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            Client& c = clients_[i];
+            std::string error;
+            c.fd = open_socket(address, false, error);
+            c.start = std::chrono::steady_clock::now();
+            if (c.fd < 0 || !set_nonblocking(c.fd)) {
+                if (failed++ == 0) {
+                    std::cerr << error << std::endl;
+                }
+                finish(c);
+                continue;
+            }
+            struct epoll_event ev {};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = i;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+        }
+
+        std::vector<struct epoll_event> events(256);
+        while (open_ > 0) {
+            const int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+            for (int i = 0; i < n; ++i) {
+                receive(clients_[events[i].data.u64], events[i].data.u64 == 0);
+            }
+        }
+        const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        close(epoll_fd);
+
+        std::vector<double> durations;
+        size_t passed = 0;
+        uint64_t received = 0;
+        for (const Client& c : clients_) {
+            passed += c.passed ? 1 : 0;
+            received += c.received;
+            if (c.fd >= 0 || c.received > 0) {
+                durations.push_back(std::chrono::duration<double>(c.end - c.start).count());
+            }
+        }
+        std::sort(durations.begin(), durations.end());
+        char line[256];
+        std::snprintf(line, sizeof(line), "%zu client(s): %zu passed, %zu could not connect, %.1f s wall, %.1f MB received",
+                      count, passed, failed, wall, received / 1e6);
+        std::cerr << line << "\n";
+        if (!durations.empty()) {
+            std::snprintf(line, sizeof(line), "session time: p50 %.2f s, p99 %.2f s, max %.2f s",
+                          durations[durations.size() / 2], durations[durations.size() * 99 / 100], durations.back());
+            std::cerr << line << "\n";
+        }
+        return passed == count ? 0 : 1;
+    }
+
+private:
+    void receive(Client& c, bool first) {
+        char buffer[16384];
+        for (;;) {
+            const ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                c.received += static_cast<uint64_t>(n);
+                if (first && echo_) {
+                    std::fwrite(buffer, 1, static_cast<size_t>(n), stdout);
+                    std::fflush(stdout);
+                }
+                scan(c, std::string_view(buffer, static_cast<size_t>(n)));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            finish(c);
+            return;
+        }
+    }
+
+    // Answers every prompt in `bytes` and looks for the expected text. The
+    // matcher state carries over between reads, so a marker split across
+    // two of them still counts, once, when the byte that completes it arrives.
+    void scan(Client& c, std::string_view bytes) {
+        markers_.scan(c.match_state, bytes, [&](size_t marker, size_t) {
+            if (marker >= std::size(PROMPTS)) {
+                c.passed = true;
+                return true;
+            }
+            if (c.next_line >= lines_.size()) {
+                return true;
+            }
+            const std::string& answer = lines_[c.next_line++];
+            if (send(c.fd, answer.data(), answer.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(answer.size())) {
+                finish(c);
+                return false;
+            }
+            return true;
+        });
+    }
+
+    void finish(Client& c) {
+        if (c.done) {
+            return;
+        }
+        c.done = true;
+        c.end = std::chrono::steady_clock::now();
+        if (expect_.empty() && c.received > 0) {
+            c.passed = true;
+        }
+        if (c.fd >= 0) {
+            close(c.fd);
+        }
+        --open_;
+    }
+
+    std::vector<std::string> lines_;
+    std::string expect_;
+    bool echo_;
+    PatternSet markers_;
+    std::vector<Client> clients_;
+    size_t open_ = 0;
+};
+
+int main(int argc, char* argv[]) {
+    std::string address;
+    size_t clients = 1;
+    std::string script = "B\nB\nB\nB\n" + std::string(CORE_PASSWORD) + "\n";
+    std::string expect = "bsctf";
+    bool echo = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--connect=", 10) == 0) {
+            address = argv[i] + 10;
+        } else if (std::strncmp(argv[i], "--clients=", 10) == 0) {
+            clients = std::max<size_t>(std::strtoul(argv[i] + 10, nullptr, 10), 1);
+        } else if (std::strncmp(argv[i], "--script=", 9) == 0) {
+            std::ifstream file(argv[i] + 9, std::ios::binary);
+            if (!file) {
+                std::cerr << "cannot open " << argv[i] + 9 << std::endl;
+                return 2;
+            }
+            script.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        } else if (std::strncmp(argv[i], "--expect=", 9) == 0) {
+            expect = argv[i] + 9;
+        } else if (std::strcmp(argv[i], "--echo") == 0) {
+            echo = true;
+        } else {
+            address.clear();
+            break;
+        }
+    }
+    if (address.empty()) {
+        std::cerr << "usage: " << argv[0]
+                  << " --connect=<address> [--clients=N] [--script=<file>] [--expect=<text>] [--echo]" << std::endl;
+        return 2;
+    }
+
+    std::vector<std::string> lines;
+    for (size_t begin = 0; begin < script.size(); ) {
+        size_t end = script.find('\n', begin);
+        end = (end == std::string::npos) ? script.size() : end + 1;
+        lines.push_back(script.substr(begin, end - begin));
+        begin = end;
+    }
+
+    LoadClient client(std::move(lines), expect, echo);
+    return client.run(address, clients);
+}
+#endif
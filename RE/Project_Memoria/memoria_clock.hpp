@@ -0,0 +1,142 @@
+// GET_TICK clock providers. Attach one through vm.clock (or set_clock() on
+// the batch drivers); a VM without a clock reads steady_clock on every
+// GET_TICK, which is what the interactive game wants.
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memoria_vm.hpp"
+
+// The TSC clock needs rdtsc and 128-bit multiplies.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MEMORIA_HAS_TSC_CLOCK 1
+#endif
+
+// TSC on x86; elsewhere steady_clock nanoseconds stand in for cycles.
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// The same time GET_TICK reads without a clock, behind the TickClock interface.
+class SteadyTickClock : public TickClock {
+public:
+    uint32_t now_ms(uint64_t) const override { return steady_clock_ms(); }
+};
+
+// steady_clock milliseconds extrapolated from rdtsc, calibrated once at
+// construction. Assumes an invariant TSC (constant_tsc/nonstop_tsc, which
+// every x86-64 CPU of the last decade has); without MEMORIA_HAS_TSC_CLOCK
+// it reads steady_clock instead.
+class TscTickClock : public TickClock {
+public:
+    explicit TscTickClock(std::chrono::milliseconds calibration = std::chrono::milliseconds(10)) {
+#ifdef MEMORIA_HAS_TSC_CLOCK
+        using clock = std::chrono::steady_clock;
+        const clock::time_point wall_start = clock::now();
+        const uint64_t tsc_start = read_cycle_counter();
+        std::this_thread::sleep_for(calibration);
+        const clock::time_point wall_end = clock::now();
+        const uint64_t tsc_end = read_cycle_counter();
+
+        const double elapsed_ns = std::chrono::duration<double, std::nano>(wall_end - wall_start).count();
+        const double cycles_per_ns = static_cast<double>(tsc_end - tsc_start) / elapsed_ns;
+        ns_per_cycle_q32_ = static_cast<uint64_t>(4294967296.0 / cycles_per_ns);
+        base_tsc_ = tsc_end;
+        base_ns_ = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wall_end.time_since_epoch()).count());
+#else
+        (void)calibration;
+#endif
+    }
+
+    uint32_t now_ms(uint64_t) const override {
+#ifdef MEMORIA_HAS_TSC_CLOCK
+        const uint64_t cycles = read_cycle_counter() - base_tsc_;
+        const uint64_t ns = static_cast<uint64_t>((static_cast<unsigned __int128>(cycles) * ns_per_cycle_q32_) >> 32);
+        return static_cast<uint32_t>((base_ns_ + ns) / 1000000);
+#else
+        return steady_clock_ms();
+#endif
+    }
+
+private:
+    uint64_t base_tsc_ = 0;
+    uint64_t base_ns_ = 0;
+    uint64_t ns_per_cycle_q32_ = 0;
+};
+
+// A background thread stores steady_clock milliseconds every `period`;
+// GET_TICK is a relaxed atomic load, at the cost of up to one period of lag.
+class CoarseTickClock : public TickClock {
+public:
+    explicit CoarseTickClock(std::chrono::milliseconds period = std::chrono::milliseconds(1))
+        : now_(steady_clock_ms()), thread_([this, period] { update_loop(period); }) {}
+
+    ~CoarseTickClock() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+    }
+
+    uint32_t now_ms(uint64_t) const override { return now_.load(std::memory_order_relaxed); }
+
+private:
+    void update_loop(std::chrono::milliseconds period) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, period, [this] { return stopping_; })) {
+            now_.store(steady_clock_ms(), std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint32_t> now_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread thread_;   // last, so it starts after everything it touches
+};
+
+// Deterministic time: start_ms plus one millisecond per instructions_per_ms
+// retired instructions (a million by default, roughly what the decoded
+// interpreter retires per millisecond). The same program and input always
+// read the same ticks, on every backend.
+class VirtualTickClock : public TickClock {
+public:
+    explicit VirtualTickClock(uint32_t start_ms = 0, uint64_t instructions_per_ms = 1000000)
+        : start_ms_(start_ms), instructions_per_ms_(instructions_per_ms > 0 ? instructions_per_ms : 1) {}
+
+    uint32_t now_ms(uint64_t instructions) const override {
+        return start_ms_ + static_cast<uint32_t>(instructions / instructions_per_ms_);
+    }
+
+private:
+    uint32_t start_ms_;
+    uint64_t instructions_per_ms_;
+};
+
+// "steady", "tsc", "coarse" or "virtual"; null for anything else.
+inline std::unique_ptr<TickClock> make_tick_clock(std::string_view name) {
+    if (name == "steady") return std::make_unique<SteadyTickClock>();
+    if (name == "tsc") return std::make_unique<TscTickClock>();
+    if (name == "coarse") return std::make_unique<CoarseTickClock>();
+    if (name == "virtual") return std::make_unique<VirtualTickClock>();
+    return nullptr;
+}
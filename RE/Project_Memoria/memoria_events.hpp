@@ -0,0 +1,235 @@
+// Terminal input for the game session. TerminalMode switches stdin between
+// the terminal's line mode and raw keypresses only when asked to change,
+// and EventLoop blocks in one poll() on stdin and a periodic timer, so the
+// game sleeps until a key arrives or the next animation tick is due.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <conio.h>
+#else
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#ifdef __linux__
+#define MEMORIA_HAS_TIMERFD 1
+#include <sys/timerfd.h>
+#endif
+#endif
+
+// Raw mode here means no line buffering and no echo, so single keypresses
+// reach the game as they are typed.
+class TerminalMode {
+public:
+#ifdef _WIN32
+    TerminalMode() = default;
+#else
+    explicit TerminalMode(int fd = STDIN_FILENO) : fd_(fd) {}
+#endif
+    TerminalMode(const TerminalMode&) = delete;
+    TerminalMode& operator=(const TerminalMode&) = delete;
+
+    ~TerminalMode() { leave_raw(); }
+
+    void enter_raw() {
+        if (raw_) {
+            return;
+        }
+#ifndef _WIN32
+        if (tcgetattr(fd_, &saved_) != 0) {
+            return;
+        }
+        struct termios raw = saved_;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(fd_, TCSANOW, &raw);
+#endif
+        raw_ = true;
+    }
+
+    void leave_raw() {
+        if (!raw_) {
+            return;
+        }
+#ifndef _WIN32
+        tcsetattr(fd_, TCSANOW, &saved_);
+#endif
+        raw_ = false;
+    }
+
+    bool raw() const { return raw_; }
+
+private:
+#ifndef _WIN32
+    int fd_;
+    struct termios saved_ {};
+#endif
+    bool raw_ = false;
+};
+
+struct InputEvent {
+    enum Type { Key, Tick, Timeout };
+    Type type = Timeout;
+    uint64_t ticks = 0;   // Tick: periods elapsed since the last tick event
+};
+
+// Waits for keypresses and ticks of an optional periodic timer. On Linux
+// the timer is a timerfd polled together with stdin; other POSIX systems
+// fold the next tick into the poll() timeout. Windows has no pollable
+// console handle here, so it checks _kbhit() between short sleeps.
+class EventLoop {
+public:
+#ifdef _WIN32
+    EventLoop() = default;
+#else
+    explicit EventLoop(int input_fd = STDIN_FILENO) : input_fd_(input_fd) {
+#ifdef MEMORIA_HAS_TIMERFD
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+    }
+#endif
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+#ifdef MEMORIA_HAS_TIMERFD
+        if (timer_fd_ >= 0) {
+            close(timer_fd_);
+        }
+#endif
+    }
+
+    // Ticks every period from now on; the first one is one period away.
+    void start_ticks(std::chrono::milliseconds period) {
+        period_ = period.count() > 0 ? period : std::chrono::milliseconds(1);
+        next_tick_ = std::chrono::steady_clock::now() + period_;
+        ticking_ = true;
+#ifdef MEMORIA_HAS_TIMERFD
+        if (timer_fd_ >= 0) {
+            struct itimerspec spec {};
+            spec.it_interval.tv_sec = period_.count() / 1000;
+            spec.it_interval.tv_nsec = (period_.count() % 1000) * 1000000;
+            spec.it_value = spec.it_interval;
+            timerfd_settime(timer_fd_, 0, &spec, nullptr);
+        }
+#endif
+    }
+
+    void stop_ticks() {
+        ticking_ = false;
+#ifdef MEMORIA_HAS_TIMERFD
+        if (timer_fd_ >= 0) {
+            struct itimerspec spec {};
+            timerfd_settime(timer_fd_, 0, &spec, nullptr);
+        }
+#endif
+    }
+
+    // Blocks until a key is pressed, the timer ticks or timeout passes (a
+    // negative timeout waits without limit). A keypress wins over a tick
+    // that is due at the same time; the bytes typed are read and dropped.
+    InputEvent wait(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) {
+        using clock = std::chrono::steady_clock;
+        const bool limited = timeout.count() >= 0;
+        const clock::time_point deadline = clock::now() + (limited ? timeout : std::chrono::milliseconds(0));
+
+        for (;;) {
+            if (const uint64_t ticks = take_due_ticks()) {
+                return InputEvent{InputEvent::Tick, ticks};
+            }
+            const clock::time_point now = clock::now();
+            if (limited && now >= deadline) {
+                return InputEvent{InputEvent::Timeout, 0};
+            }
+            // Sleep until the deadline, or until the next tick when no
+            // timerfd will wake us for it.
+            bool has_wake = limited;
+            clock::time_point wake = deadline;
+            if (ticking_ && !uses_timerfd() && (!limited || next_tick_ < wake)) {
+                wake = next_tick_;
+                has_wake = true;
+            }
+            const int wait_ms = has_wake ? static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wake - now).count()) : -1;
+
+#ifdef _WIN32
+            if (_kbhit()) {
+                while (_kbhit()) {
+                    _getch();
+                }
+                return InputEvent{InputEvent::Key, 0};
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms >= 0 && wait_ms < 10 ? wait_ms : 10));
+#else
+            struct pollfd fds[2] = {};
+            fds[0].fd = input_fd_;
+            fds[0].events = POLLIN;
+            nfds_t count = 1;
+#ifdef MEMORIA_HAS_TIMERFD
+            if (ticking_ && uses_timerfd()) {
+                fds[1].fd = timer_fd_;
+                fds[1].events = POLLIN;
+                count = 2;
+            }
+#endif
+            if (poll(fds, count, wait_ms) <= 0) {
+                continue;   // timed out or interrupted; the checks above decide
+            }
+            if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                char typed[64];
+                const ssize_t n = read(input_fd_, typed, sizeof(typed));
+                if (n > 0) {
+                    return InputEvent{InputEvent::Key, 0};
+                }
+                if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                    input_fd_ = -1;   // end of input; poll() skips negative descriptors
+                }
+            }
+#ifdef MEMORIA_HAS_TIMERFD
+            if (count == 2 && (fds[1].revents & POLLIN) != 0) {
+                uint64_t expirations = 0;
+                if (read(timer_fd_, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 0) {
+                    return InputEvent{InputEvent::Tick, expirations};
+                }
+            }
+#endif
+#endif
+        }
+    }
+
+private:
+    bool uses_timerfd() const {
+#ifdef MEMORIA_HAS_TIMERFD
+        return timer_fd_ >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // Ticks that are due, for timers kept by hand rather than by a timerfd.
+    uint64_t take_due_ticks() {
+        if (!ticking_ || uses_timerfd()) {
+            return 0;
+        }
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now < next_tick_) {
+            return 0;
+        }
+        const uint64_t ticks = 1 + static_cast<uint64_t>((now - next_tick_) / period_);
+        next_tick_ += period_ * ticks;
+        return ticks;
+    }
+
+#ifndef _WIN32
+    int input_fd_;
+#endif
+#ifdef MEMORIA_HAS_TIMERFD
+    int timer_fd_ = -1;
+#endif
+    bool ticking_ = false;
+    std::chrono::milliseconds period_{10};
+    std::chrono::steady_clock::time_point next_tick_{};
+};
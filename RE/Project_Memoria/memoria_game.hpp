@@ -0,0 +1,569 @@
+// The game engine and its built-in story. HakoniwaSession plays any Story
+// through a GameIo, on the terminal or headless: scenes and choices until
+// the password prompt, the password check on the VM, then the epilogue or
+// the failure screen. The Hakoniwa story, with Aoi's dialogue and the four
+// choices that earn the program chunks, is compiled in as builtin_story().
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "memoria_backends.hpp"
+#include "memoria_programs.hpp"
+#include "memoria_profile.hpp"
+#include "memoria_screen.hpp"
+#include "memoria_text.hpp"
+#include "memoria_session.hpp"
+#include "memoria_story.hpp"
+
+inline constexpr int SCREEN_WIDTH = 110;
+
+
+inline const std::string ART_GARDEN = R"(
+
+                ,d88b.d88b,
+                88888888888
+                `Y8888888Y'
+                  `Y888Y'
+                    `Y'
+      -------------------------------------
+      |                                   |
+      |   - PROJECT: HAKONIWA -           |
+      |                                   |
+      -------------------------------------
+          ,d88b.d88b,               ,d88b.d88b,
+          88888888888               88888888888
+          `Y8888888Y'               `Y8888888Y'
+            `Y888Y'                   `Y888Y'
+              `Y'                       `Y'
+
+)";
+
+inline const std::string ART_NOISE = R"(
+
+      █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █
+      █ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ █
+      █ ▓ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ▓ █
+      █ ▓ ░ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ░ ▓ █
+      █ ▓ ░ ▒ █ ▓ ░ ▒ █ ▓ ░ ▒ █ ▓ ░ ▒ ░ ▓ █
+      █ ▓ ░ ▒ ░ ▓ █ ▒ ░ ▓ █ ▒ ░ ▓ █ ▒ ░ ▓ █
+      █ ▓ ░ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ▒ ░ ▓ █
+      █ ▓ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ░ ▓ █
+      █ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ ▓ █
+      █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █ █
+
+)";
+
+inline const std::string ART_KEY = R"(
+                 .--.
+                /.-. '----------.
+                \'-' .--"--""-"-'
+                 '--'
+    A L P H A   -   F O X T R O T
+)";
+
+inline const std::string ART_HOURGLASS = R"(
+                   .--.
+                  |o_o |
+                  |:_/ |
+                 //   \ \
+                (|     | )
+               /'\_   _/`\
+               \___)=(___/
+)";
+
+inline const std::string ART_CONNECTION_LOST = R"(
+
+           .--.
+          |o_o |
+          |:_/ |
+         //   \ \
+        /COMMUNICATION
+       /   ERROR   `\
+       \___)=(___/
+
+--- C O N N E C T I O N   L O S T ---
+)";
+
+inline const std::string ART_EPILOGUE = R"(
+      d8888b. d8888b. d88888b d8888b. d888888b
+      88  `8D 88  `8D 88'     88  `8D   `88'
+      88oooY' 88oobY' 88ooooo 88oobY'    88
+      88~~~b. 88`8b   88~~~~~ 88`8b      88
+      88   8D 88 `88. 88.     88 `88.   .88.
+      Y8888P' Y8888P' Y88888P Y8888P' Y888888P
+
+      [S Y S T E M   C O R E   S T A B I L I Z E D]
+)";
+
+
+// Every screen is composed into one frame. Rows can run past SCREEN_WIDTH when the right border is
+// pushed out by wide characters, so the frame has some room to spare.
+inline constexpr int FRAME_COLUMNS = SCREEN_WIDTH + 16;
+
+inline void write_box_border(FrameBuffer& frame) {
+    frame.write(" ");
+    frame.write_repeated('-', SCREEN_WIDTH - 2);
+    frame.write(" \n");
+}
+
+inline void write_box_blank_line(FrameBuffer& frame) {
+    frame.write("|");
+    frame.write_repeated(' ', SCREEN_WIDTH - 2);
+    frame.write("|\n");
+}
+
+// Columns the dialogue box lays text out in: dialogue sits between "|  "
+// and "  |", the choices between "| " and " |".
+inline constexpr int DIALOGUE_WIDTH = SCREEN_WIDTH - 6;
+inline constexpr int CHOICE_WIDTH = SCREEN_WIDTH - 4;
+
+inline LayoutCache& layout_cache() {
+    static LayoutCache cache;
+    return cache;
+}
+
+inline std::string dialogue_text(std::string_view character, std::string_view text) {
+    std::string line;
+    line.reserve(character.size() + text.size() + 7);
+    line.append(character).append(" 「").append(text).append("」");
+    return line;
+}
+
+inline std::string choice_text(char label, std::string_view choice) {
+    return std::string("  ") + label + ". " + std::string(choice);
+}
+
+inline constexpr std::chrono::milliseconds TYPEWRITER_PERIOD{10};
+inline constexpr std::chrono::milliseconds DIALOGUE_PAUSE{500};
+
+// Types dialogue into a frame one glyph per TYPEWRITER_PERIOD, driven by
+// the session's ticks; a tick that arrives late reveals every glyph that
+// is due. Any key skips the rest of the frame's animation.
+class Typewriter {
+public:
+    Typewriter(FrameBuffer& frame, GameIo& io) : frame_(frame), io_(io) {}
+
+    ~Typewriter() { io_.stop_ticks(); }
+
+    void type(std::string_view text) {
+        for (size_t i = 0; i < text.size(); ) {
+            if (skipping_) {
+                frame_.write(text.substr(i));
+                return;
+            }
+            if (due_ == 0) {
+                wait_for_tick();
+                continue;
+            }
+            for (; due_ > 0 && i < text.size(); --due_) {
+                const size_t size = next_glyph(text.data() + i, text.size() - i).size;
+                frame_.write(text.substr(i, size));
+                i += size;
+            }
+            io_.present(frame_);
+        }
+    }
+
+    // Shows the frame so far and holds it for `duration` or until a key is
+    // pressed. The ticker is stopped meanwhile, so a pause costs one wakeup.
+    void pause(std::chrono::milliseconds duration) {
+        if (skipping_) {
+            return;
+        }
+        io_.present(frame_);
+        io_.stop_ticks();
+        ticking_ = false;
+        if (io_.wait(duration).type == InputEvent::Key) {
+            skipping_ = true;
+        }
+    }
+
+private:
+    void wait_for_tick() {
+        if (!ticking_) {
+            // The first glyph goes out straight away, the rest on ticks.
+            io_.start_ticks(TYPEWRITER_PERIOD);
+            ticking_ = true;
+            due_ = 1;
+            return;
+        }
+        const InputEvent event = io_.wait();
+        if (event.type == InputEvent::Key) {
+            skipping_ = true;
+        } else {
+            due_ += event.ticks;
+        }
+    }
+
+    FrameBuffer& frame_;
+    GameIo& io_;
+    bool ticking_ = false;
+    bool skipping_ = false;
+    uint64_t due_ = 0;
+};
+
+inline DialogueList bad_end_dialogues(const std::string& message) {
+    return {{"???", message}};
+}
+
+
+
+inline const std::string LOG_ENTRY_TEXT =
+    "'Aoi. By the time someone activates this log, Papa will already be gone.'"
+    "'Your illness was beyond any help. The time I had left was far too short, and all I could do was transfer your consciousness to this imperfect \"Garden\". I'm so sorry.'"
+    "'The \"tuning\" you spoke of... that agonizing data stabilization load (the noise)... I can only imagine the pain it caused you. I was desperately trying to burn your name (Aoi) and the reboot code (the seed value) into your memory, praying someone in the future would find you. ...I was a terrible father, wasn't I? I won't ask for your forgiveness.'"
+    "'If a hacker kind enough to run this project appears, they are the one who inherits my will. Please, let the world Aoi sees no longer be filled with pain.'"
+    "'Ah, it seems my time is up. Lastly, know that these words are the absolute truth.'"
+    "'I love you, Aoi. Always.'";
+
+inline const DialogueList EPILOGUE_DIALOGUES = {
+    { "[Date: 2024.10.15]", "" },
+    { "Log Entry", LOG_ENTRY_TEXT },
+    { "[Log Entry Ends]", "" }
+};
+
+inline const DialogueList AUTH_FAILED_DIALOGUES = {{"SYSTEM", "AUTHENTICATION FAILED..."}};
+
+
+
+// One step of the story: Aoi's lines and the two answers. Answer B is the
+// one that lets her trust you; it earns the next chunk of the program.
+struct StoryScene {
+    const std::string& art;
+    DialogueList dialogues;
+    std::string choice_a;
+    std::string choice_b;
+    DialogueList accepted;   // shown after B
+    std::string rejected;    // bad end after A
+    BytecodeView chunk;      // decrypted into the program after B
+};
+
+inline const StoryScene STORY_SCENES[] = {
+    {
+        ART_GARDEN,
+        {
+            {"Aoi", "...Finally... has someone come? I've been alone for so, so long..."},
+            {"Aoi", "They call this place the 'Garden', but to me, it's just a beautiful cage. The flowers never wilt, and the sky never changes color. ...It's so perfect, it's suffocating."},
+            {"Aoi", "Papa called this place the 'Core'. He said it was a precious place where my entire being exists. But he never let me take a single step outside of it. He locked every door with a key I could never open... Hey, you're... you're not like Papa, are you? Do you think this Core is meant to 'imprison' me? Or..."},
+        },
+        "It's a prison, built to trap you.",
+        "I want to believe it's a final fortress, built to protect you.",
+        {{"Aoi", "...I see. ...You say the same thing Papa did. But... your words, they feel a little warmer, somehow... Is it okay... to believe you?"}},
+        "...You're right. That's what you think, too... I guess I really can't trust anyone...",
+        encrypted_chunk1,
+    },
+    {
+        ART_NOISE,
+        {
+            {"Aoi", "Even when I want to believe, I'm still scared. Because Papa would sometimes say 'It's time for your tuning,' and then do terrible things to me."},
+            {"Aoi", "It feels like cold noise is pouring directly into my head, scrambling all my memories... My precious memories get forcibly 'added' to things I don't know, 'mixed' into different memories... It feels like I'm ceasing to be me..."},
+            {"Aoi", "He tinkers with me, as if replacing a faulty part, just to make sure I stay a 'good girl'. Hey... am I just being punished because I'm 'broken'? Or... is there some other reason...?"},
+        },
+        "That's right, he's just breaking you.",
+        "...Maybe he was desperately trying to hold you together, so you wouldn't break.",
+        {{"Aoi", "To keep me... from breaking...? I never thought of it like that... How could it be, when it hurt so much...? But... if you say so, then maybe... just for a moment, the pain feels like it's fading. It's strange..."}},
+        "I knew it... I'm just a doll, waiting to be broken...",
+        encrypted_chunk2,
+    },
+    {
+        ART_KEY,
+        {
+            {"Aoi", "I remembered something else... something that binds me here. When I was sick with a fever, Papa would whisper the same words into my ear, over and over."},
+            {"Aoi", "In a voice as cold as ice, 'Alpha, Foxtrot'... It was like he was branding my very soul... I think it's a powerful curse, to make sure I can never escape from here, even if I forget everything else."},
+            {"Aoi", "...Don't let these words trap you, too. I'm sure they are wicked words that must never be solved..."},
+        },
+        "Let's just forget about a curse like that.",
+        "It's not a curse. I'm sure it's the 'key' to the most important door.",
+        {{"Aoi", "A key...? Not a curse...? I... I never imagined... If it's really a key, what door does it open? ...I'm scared. But if you're with me, I feel like I want to see what's on the other side... That's strange, isn't it?"}},
+        "Yeah... let's forget it. When I'm with you, I feel like I can forget the bad things... But... wait...? I feel like I've forgotten something... important...",
+        encrypted_chunk3,
+    },
+    {
+        ART_HOURGLASS,
+        {
+            {"Aoi", "...It looks like there's not much time left. The noise... it's starting to eat into my very core..."},
+            {"Aoi", "I just remembered the last words Papa said to me when he left. Without a single glance back, he told me coldly, 'Listen, not even a moment's hesitation will be tolerated.'"},
+            {"Aoi", "...He must have known I would try to escape. And that was his final threat... that if I did, he would erase me instantly. But I'm done being his puppet. ...You can overcome this threat, can't you? Seize this last chance, with me...!"},
+        },
+        "Don't give in to threats. We'll find a way, slowly.",
+        "No... that was encouragement, telling you 'Don't miss your chance'!",
+        {{"Aoi", "Encouragement...! I see, you're right! When I talk to you, even words that sounded like curses start to sound like words of hope! ...Yes, I'll believe in you! Seize this last chance!"}},
+        "Slowly...? But there's no time! The noise is... ah...!",
+        encrypted_chunk4,
+    },
+};
+
+inline const std::string ACCESS_TITLE = "--- CORE SYSTEM ACCESS ---";
+inline const std::string FLAG_MARKER = "bsctf";
+
+// The Hakoniwa story as a story image: answer A is a bad end, answer B
+// earns the scene's chunk and moves on. Built on first use.
+inline const std::string& builtin_story_image() {
+    static const std::string image = [] {
+        StoryWriter writer;
+        writer.set_key(std::string(1, static_cast<char>(HAKONIWA_CHUNK_KEY)));
+        writer.set_program_capacity(HAKONIWA_IMAGE_SIZE);
+        writer.set_access(ART_KEY, ACCESS_TITLE, FLAG_MARKER);
+        writer.set_epilogue(ART_EPILOGUE, EPILOGUE_DIALOGUES);
+        writer.set_failure(ART_CONNECTION_LOST, AUTH_FAILED_DIALOGUES);
+        const uint32_t count = static_cast<uint32_t>(std::size(STORY_SCENES));
+        for (uint32_t i = 0; i < count; ++i) {
+            const StoryScene& scene = STORY_SCENES[i];
+            const uint32_t index = writer.add_scene(scene.art, scene.dialogues);
+            writer.add_choice(index, scene.choice_a, ART_CONNECTION_LOST, bad_end_dialogues(scene.rejected),
+                              BytecodeView(), STORY_NEXT_BAD_END);
+            writer.add_choice(index, scene.choice_b, "", scene.accepted, scene.chunk,
+                              i + 1 < count ? i + 1 : STORY_NEXT_ACCESS);
+        }
+        return writer.finish();
+    }();
+    return image;
+}
+
+inline const Story& builtin_story() {
+    static const Story story = [] {
+        Story s;
+        std::string error;
+        if (!s.load(builtin_story_image(), error)) {
+            // Only a StoryWriter bug gets here; there is no story to play.
+            std::cerr << "built-in story: " << error << std::endl;
+            std::abort();
+        }
+        return s;
+    }();
+    return story;
+}
+
+// Lays out all of a story's text up front, so draw_frame only copies
+// finished lines into the frame.
+inline void warm_layout_cache(const Story& story) {
+    LayoutCache& layouts = layout_cache();
+    auto add_dialogues = [&](Story::Lines lines) {
+        for (Story::Line line : lines) {
+            layouts.wrapped(dialogue_text(line.speaker, line.text), DIALOGUE_WIDTH);
+        }
+    };
+    for (uint32_t i = 0; i < story.scene_count(); ++i) {
+        const Story::Scene scene = story.scene(i);
+        add_dialogues(scene.lines);
+        for (uint32_t c = 0; c < scene.choices.count; ++c) {
+            const Story::Choice choice = story.choice(scene, c);
+            layouts.line(choice_text(static_cast<char>('A' + c), choice.text), CHOICE_WIDTH);
+            add_dialogues(choice.response);
+        }
+    }
+    add_dialogues(story.epilogue_lines());
+    add_dialogues(story.failure_lines());
+}
+
+// Hakoniwa VM with per-opcode profiling, used for --profile runs.
+using ProfiledHakoniwaVm = VmTraits<HakoniwaOpcodes, AttachedIo, ResultHalt, OpcodeProfile>;
+
+struct SessionOptions {
+    DispatchMode dispatch = default_dispatch_mode;
+    // Check the password on the profiled interpreter and report to std::cerr.
+    bool profile = false;
+    // GET_TICK source for the password check; steady_clock when null.
+    const TickClock* clock = nullptr;
+};
+
+// One playthrough of a story: scenes until a choice leads to the password
+// prompt or a bad end, then the password check and either the epilogue or
+// the failure screen. Everything the player sees and types goes through
+// the GameIo.
+class HakoniwaSession {
+public:
+    explicit HakoniwaSession(GameIo& io, const Story& story = builtin_story())
+        : io_(io), story_(story), frame_(FRAME_COLUMNS) {
+        success_marker_.add(story_.success_marker());
+        success_marker_.compile();
+    }
+
+    // Returns the game's exit status: 1 after a bad end or when input runs
+    // out at a prompt, 0 once the password has been checked.
+    int run(const SessionOptions& options = SessionOptions()) {
+        authenticated_ = false;
+        ProgramImage final_bytecode(story_.program_capacity());
+        const BytecodeView key = story_.key();
+
+        for (uint32_t index = 0; index != STORY_NEXT_ACCESS; ) {
+            const Story::Scene scene = story_.scene(index);
+            draw_frame(scene.art, scene.lines, &scene);
+
+            const int answer = get_choice(scene.choices.count);
+            if (answer < 0) {
+                return 1;
+            }
+            const Story::Choice choice = story_.choice(scene, static_cast<size_t>(answer));
+            draw_frame(choice.art.empty() ? scene.art : choice.art, choice.response);
+            if (choice.next == STORY_NEXT_BAD_END) {
+                io_.print("\n\n\n");
+                return 1;
+            }
+            io_.sleep(std::chrono::seconds(2));
+            final_bytecode.append_decrypted(choice.fragment, key.data(), key.size());
+            index = choice.next;
+        }
+
+        FrameBuffer& access_frame = begin_screen();
+        access_frame.write(story_.access_art());
+        access_frame.write("\n");
+        write_box_border(access_frame);
+        write_box_blank_line(access_frame);
+        access_frame.write("|   ");
+        access_frame.write(story_.access_title());
+        access_frame.write_repeated(' ', std::max(0, SCREEN_WIDTH - 4 - display_width(story_.access_title())));
+        access_frame.write("|\n");
+        access_frame.write("|   Password: ");
+        io_.present(access_frame);
+
+        VirtualMachine vm;
+        ArenaSink captured_output;
+        MatchSink output(success_marker_, &captured_output);
+        vm.input = &io_.line_input();
+        vm.output = &output;
+        vm.clock = options.clock;
+
+        if (options.profile) {
+            VmProfile profile;
+            vm.profile = &profile;
+            run_vm_switch<ProfiledHakoniwaVm>(vm, final_bytecode.view());
+            profile.report(std::cerr);
+        } else {
+            run_vm(vm, final_bytecode.view(), options.dispatch);
+        }
+        output.flush();
+
+        std::string_view vm_output = captured_output.view();
+
+        io_.print(vm_output);
+
+        if (output.matched(0)) {
+            authenticated_ = true;
+            show_epilogue(vm_output);
+        } else {
+            draw_frame(story_.failure_art(), story_.failure_lines());
+            io_.print("\n\n--- SYSTEM STABILIZATION FAILED ---\n");
+        }
+
+        return 0;
+    }
+
+    // Whether the last run() got the flag out of the VM.
+    bool authenticated() const { return authenticated_; }
+
+private:
+    FrameBuffer& begin_screen() {
+        io_.begin_screen();
+        frame_.clear();
+        return frame_;
+    }
+
+    // Draws art and typed dialogue in the box, with the scene's choices
+    // under it when one is given.
+    void draw_frame(std::string_view art, Story::Lines dialogues, const Story::Scene* choices_of = nullptr) {
+        FrameBuffer& frame = begin_screen();
+        Typewriter typewriter(frame, io_);
+        frame.write(art);
+        frame.write("\n");
+
+        write_box_border(frame);
+        write_box_blank_line(frame);
+
+        LayoutCache& layouts = layout_cache();
+        for (Story::Line p : dialogues) {
+            const std::vector<TextLine>& wrapped_lines = layouts.wrapped(dialogue_text(p.speaker, p.text), DIALOGUE_WIDTH);
+
+            for (const TextLine& line : wrapped_lines) {
+                frame.write("|  ");
+
+                typewriter.type(line.text);
+                frame.write_repeated(' ', line.padding);
+                frame.write("  |\n");
+            }
+
+            write_box_blank_line(frame);
+
+            typewriter.pause(DIALOGUE_PAUSE);
+        }
+
+        if (choices_of != nullptr) {
+            frame.write("| ");
+            frame.write_repeated('-', SCREEN_WIDTH - 4);
+            frame.write(" |\n");
+            write_box_blank_line(frame);
+
+            for (uint32_t i = 0; i < choices_of->choices.count; ++i) {
+                const Story::Choice choice = story_.choice(*choices_of, i);
+                const TextLine& line = layouts.line(choice_text(static_cast<char>('A' + i), choice.text), CHOICE_WIDTH);
+                frame.write("| ");
+                frame.write(line.text);
+                frame.write_repeated(' ', line.padding);
+                frame.write(" |\n");
+            }
+        }
+
+        write_box_blank_line(frame);
+        write_box_border(frame);
+        io_.present(frame);
+    }
+
+    // Reads answers until one names one of `count` choices, and returns its
+    // index. Returns -1 if input runs out first.
+    int get_choice(uint32_t count) {
+        std::string hint = "Choose A";
+        for (uint32_t i = 1; i < count; ++i) {
+            hint += (i + 1 < count) ? ", " : " or ";
+            hint += static_cast<char>('A' + i);
+        }
+        hint += "\n";
+
+        InputSource& input = io_.line_input();
+        while (true) {
+            io_.print("\n> ");
+            char c;
+            do {
+                if (!input.get(c)) {
+                    return -1;
+                }
+            } while (std::isspace(static_cast<unsigned char>(c)));
+            // The rest of the line is ignored.
+            for (char rest = c; rest != '\n' && input.get(rest); ) {
+            }
+            const int choice = std::toupper(static_cast<unsigned char>(c)) - 'A';
+            if (choice >= 0 && static_cast<uint32_t>(choice) < count) {
+                return choice;
+            }
+            io_.print(hint);
+        }
+    }
+
+    void show_epilogue(std::string_view final_flag) {
+        draw_frame(story_.epilogue_art(), story_.epilogue_lines());
+
+        io_.print("\n\n> Final Command Accepted.\n");
+        io_.print("> ...Initializing Project Memoria...\n");
+        io_.print("> ...Playback of last log entry initiated.\n");
+        io_.print(final_flag);
+        io_.print("\n");
+        io_.sleep(std::chrono::seconds(2));
+    }
+
+    GameIo& io_;
+    const Story& story_;
+    FrameBuffer frame_;
+    // Matched against the VM's output as it is written.
+    PatternSet success_marker_;
+    bool authenticated_ = false;
+};
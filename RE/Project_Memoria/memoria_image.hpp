@@ -0,0 +1,141 @@
+// Program images: encrypted payloads are XOR-decrypted straight into one
+// aligned buffer that is sized once and never reallocated, and the
+// interpreters run from that buffer through BytecodeView.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <memory>
+#include <utility>
+
+#include "memoria_vm.hpp"
+
+// The vector path uses GCC/Clang vector extensions; without AVX2 the
+// compiler splits each 32-byte block into two SSE2 operations.
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMORIA_HAS_VECTOR_XOR 1
+#endif
+
+// dst[i] = src[i] ^ key[(key_offset + i) % key_size] for i in [0, size).
+// dst may equal src. An empty key copies the payload unchanged.
+inline void xor_decrypt(uint8_t* dst, const uint8_t* src, size_t size,
+                        const uint8_t* key, size_t key_size, size_t key_offset = 0) {
+    if (key_size == 0) {
+        if (dst != src) {
+            std::memmove(dst, src, size);
+        }
+        return;
+    }
+    size_t phase = key_offset % key_size;
+    size_t i = 0;
+
+#ifdef MEMORIA_HAS_VECTOR_XOR
+    typedef uint8_t xor_u8x32 __attribute__((vector_size(32)));
+    const size_t BLOCK = sizeof(xor_u8x32);
+
+    if (size >= BLOCK) {
+        // Keys shorter than 256 bytes are repeated out to key_size + BLOCK
+        // bytes, so the key bytes for any phase are one unaligned load.
+        // Longer keys are loaded in place and only copied at the wrap.
+        uint8_t repeated[256 + BLOCK];
+        uint8_t wrapped[BLOCK];
+        const bool short_key = key_size < 256;
+        if (short_key) {
+            for (size_t k = 0; k < key_size + BLOCK; ++k) {
+                repeated[k] = key[k % key_size];
+            }
+        }
+        const size_t step = BLOCK % key_size;
+
+        for (; i + BLOCK <= size; i += BLOCK) {
+            const uint8_t* key_bytes;
+            if (short_key) {
+                key_bytes = repeated + phase;
+            } else if (phase + BLOCK <= key_size) {
+                key_bytes = key + phase;
+            } else {
+                const size_t head = key_size - phase;
+                std::memcpy(wrapped, key + phase, head);
+                std::memcpy(wrapped + head, key, BLOCK - head);
+                key_bytes = wrapped;
+            }
+            xor_u8x32 data, mask;
+            std::memcpy(&data, src + i, BLOCK);
+            std::memcpy(&mask, key_bytes, BLOCK);
+            data ^= mask;
+            std::memcpy(dst + i, &data, BLOCK);
+
+            phase += step;
+            if (phase >= key_size) {
+                phase -= key_size;
+            }
+        }
+    }
+#endif
+
+    for (; i < size; ++i) {
+        dst[i] = src[i] ^ key[phase];
+        if (++phase == key_size) {
+            phase = 0;
+        }
+    }
+}
+
+// A bytecode image in one cache-line-aligned allocation whose capacity is
+// fixed at construction. Payloads are decrypted into the tail in place, so
+// the plaintext is written exactly once; view() is what the interpreters run.
+class ProgramImage {
+public:
+    static constexpr size_t ALIGNMENT = 64;
+
+    ProgramImage() = default;
+    explicit ProgramImage(size_t capacity)
+        : data_(capacity > 0 ? static_cast<uint8_t*>(::operator new(capacity, std::align_val_t(ALIGNMENT))) : nullptr),
+          capacity_(capacity) {}
+
+    ProgramImage(ProgramImage&& other) noexcept
+        : data_(std::move(other.data_)),
+          capacity_(std::exchange(other.capacity_, 0)),
+          size_(std::exchange(other.size_, 0)) {}
+
+    ProgramImage& operator=(ProgramImage&& other) noexcept {
+        data_ = std::move(other.data_);
+        capacity_ = std::exchange(other.capacity_, 0);
+        size_ = std::exchange(other.size_, 0);
+        return *this;
+    }
+
+    // Decrypts one payload after the current end; the key restarts at its
+    // first byte for every payload. Returns false, appending nothing, when
+    // the payload does not fit.
+    bool append_decrypted(BytecodeView payload, const uint8_t* key, size_t key_size) {
+        if (payload.size() > capacity_ - size_) {
+            return false;
+        }
+        xor_decrypt(data_.get() + size_, payload.data(), payload.size(), key, key_size);
+        size_ += payload.size();
+        return true;
+    }
+
+    bool append_decrypted(BytecodeView payload, uint8_t key) {
+        return append_decrypted(payload, &key, 1);
+    }
+
+    void clear() { size_ = 0; }
+
+    BytecodeView view() const { return BytecodeView(data_.get(), size_); }
+    const uint8_t* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+
+private:
+    struct AlignedDelete {
+        void operator()(uint8_t* p) const { ::operator delete(p, std::align_val_t(ALIGNMENT)); }
+    };
+
+    std::unique_ptr<uint8_t, AlignedDelete> data_;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+};
@@ -0,0 +1,264 @@
+// Streaming pattern matching on VM output. PatternSet compiles any number
+// of byte strings into one Aho-Corasick automaton, flattened to a DFA over
+// the bytes the patterns use, so scanning costs a table load per byte
+// whatever the number of patterns. MatchSink runs a VM's output through it
+// as the bytes are written, so a caller learns what the output said
+// without keeping it, and can stop the VM as soon as it knows.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "memoria_vm.hpp"
+
+class PatternSet {
+public:
+    // Returns the pattern's index. Call compile() before scanning; an empty
+    // pattern never matches.
+    size_t add(std::string_view pattern) {
+        patterns_.emplace_back(pattern);
+        return patterns_.size() - 1;
+    }
+
+    void compile() {
+        class_of_.fill(0);
+        classes_ = 1;
+        for (const std::string& pattern : patterns_) {
+            for (unsigned char byte : pattern) {
+                if (class_of_[byte] == 0) {
+                    class_of_[byte] = static_cast<uint16_t>(classes_++);
+                }
+            }
+        }
+
+        // The trie, with -1 for missing edges; state 0 is the root.
+        std::vector<int32_t> next(classes_, -1);
+        std::vector<std::vector<uint32_t>> ends(1);
+        for (size_t index = 0; index < patterns_.size(); ++index) {
+            const std::string& pattern = patterns_[index];
+            if (pattern.empty()) {
+                continue;
+            }
+            size_t state = 0;
+            for (unsigned char byte : pattern) {
+                const size_t edge = state * classes_ + class_of_[byte];
+                if (next[edge] < 0) {
+                    next[edge] = static_cast<int32_t>(ends.size());
+                    ends.emplace_back();
+                    next.resize(next.size() + classes_, -1);
+                }
+                state = static_cast<size_t>(next[edge]);
+            }
+            ends[state].push_back(static_cast<uint32_t>(index));
+        }
+
+        // Breadth first, so a state's failure link is finished before its
+        // children need it. Missing edges take the failure state's edge,
+        // which turns the trie into the DFA; matches are inherited too.
+        const size_t states = ends.size();
+        std::vector<uint32_t> fail(states, 0);
+        std::deque<uint32_t> queue;
+        for (size_t c = 0; c < classes_; ++c) {
+            if (next[c] < 0) {
+                next[c] = 0;
+            } else {
+                queue.push_back(static_cast<uint32_t>(next[c]));
+            }
+        }
+        while (!queue.empty()) {
+            const uint32_t state = queue.front();
+            queue.pop_front();
+            const std::vector<uint32_t>& inherited = ends[fail[state]];
+            ends[state].insert(ends[state].end(), inherited.begin(), inherited.end());
+            for (size_t c = 0; c < classes_; ++c) {
+                int32_t& edge = next[state * classes_ + c];
+                const int32_t fallback = next[fail[state] * classes_ + c];
+                if (edge < 0) {
+                    edge = fallback;
+                } else {
+                    fail[edge] = static_cast<uint32_t>(fallback);
+                    queue.push_back(static_cast<uint32_t>(edge));
+                }
+            }
+        }
+
+        // States where a pattern ends are renumbered after all the others,
+        // so telling them apart is one compare, and every state is stored
+        // as its row offset, so a step is one add and one load. The root
+        // ends no pattern and stays first.
+        std::vector<uint32_t> order;
+        for (int accepting = 0; accepting < 2; ++accepting) {
+            for (uint32_t state = 0; state < states; ++state) {
+                if (ends[state].empty() == (accepting == 0)) {
+                    order.push_back(state);
+                }
+            }
+        }
+        std::vector<uint32_t> renumbered(states);
+        first_accepting_ = static_cast<uint32_t>(states * classes_);
+        for (uint32_t index = 0; index < states; ++index) {
+            renumbered[order[index]] = index;
+            if (!ends[order[index]].empty() && first_accepting_ == states * classes_) {
+                first_accepting_ = static_cast<uint32_t>(index * classes_);
+            }
+        }
+        table_.resize(next.size());
+        match_begin_.assign(1, 0);
+        match_ids_.clear();
+        for (uint32_t index = 0; index < states; ++index) {
+            const uint32_t state = order[index];
+            for (size_t c = 0; c < classes_; ++c) {
+                table_[index * classes_ + c] = static_cast<uint32_t>(renumbered[next[state * classes_ + c]] * classes_);
+            }
+            match_ids_.insert(match_ids_.end(), ends[state].begin(), ends[state].end());
+            match_begin_.push_back(static_cast<uint32_t>(match_ids_.size()));
+        }
+    }
+
+    size_t size() const { return patterns_.size(); }
+    const std::string& pattern(size_t index) const { return patterns_[index]; }
+    size_t states() const { return match_begin_.empty() ? 0 : match_begin_.size() - 1; }
+
+    static constexpr uint32_t start() { return 0; }
+
+    // Runs `data` through the automaton from `state`, which is updated as
+    // it goes. on_match(pattern, end) is called for every occurrence, `end`
+    // being the offset in `data` just past it; returning false stops the
+    // scan right there, and scan() returns false too.
+    template <class OnMatch>
+    bool scan(uint32_t& state, std::string_view data, OnMatch&& on_match) const {
+        const uint32_t* const table = table_.data();
+        const uint16_t* const class_of = class_of_.data();
+        const uint32_t first_accepting = first_accepting_;
+        uint32_t s = state;
+        for (size_t i = 0; i < data.size(); ++i) {
+            s = table[s + class_of[static_cast<unsigned char>(data[i])]];
+            if (s >= first_accepting) {
+                const size_t row = s / classes_;
+                for (uint32_t k = match_begin_[row]; k < match_begin_[row + 1]; ++k) {
+                    if (!on_match(static_cast<size_t>(match_ids_[k]), i + 1)) {
+                        state = s;
+                        return false;
+                    }
+                }
+            }
+        }
+        state = s;
+        return true;
+    }
+
+private:
+    std::vector<std::string> patterns_;
+    // 0 for bytes no pattern uses, so patterns that use every byte value
+    // need 257 classes.
+    std::array<uint16_t, 256> class_of_{};
+    size_t classes_ = 1;
+    std::vector<uint32_t> table_;
+    uint32_t first_accepting_ = 0;   // row offset of the first state that ends a pattern
+    // Patterns ending in each state, longest first, flattened.
+    std::vector<uint32_t> match_begin_;
+    std::vector<uint32_t> match_ids_;
+};
+
+// Scans PUTC output a window at a time: bytes land in a small buffer as
+// usual and are matched when it fills and on flush(), then handed on to
+// `forward` if there is one and forgotten. With stop_at_match the first
+// occurrence of any pattern ends the output: the sink stalls, so a
+// suspending interpreter (or run_decoded) returns OutputFull within a
+// window's worth of PUTCs, and everything past the end of the match is
+// dropped, so `forward` never sees it. Call flush() once the VM halts to
+// match the last partial window.
+class MatchSink : public OutputSink {
+public:
+    explicit MatchSink(const PatternSet& patterns, OutputSink* forward = nullptr, bool stop_at_match = false,
+                       size_t window = 64)
+        : patterns_(patterns), forward_(forward), stop_at_match_(stop_at_match), window_(window > 0 ? window : 1),
+          seen_(patterns.size(), 0) {
+        reset();
+    }
+
+    // Ready for another run with the same patterns.
+    void reset() {
+        state_ = PatternSet::start();
+        scanned_ = 0;
+        first_match_ = -1;
+        first_match_end_ = 0;
+        stalls_ = false;
+        std::fill(seen_.begin(), seen_.end(), 0);
+        cursor_ = window_.data();
+        limit_ = window_.data() + window_.size();
+    }
+
+    // Once stopped there is nothing left to match, but what was forwarded
+    // still has to reach its destination.
+    void flush() override {
+        if (!stalls_) {
+            scan_window();
+        }
+        if (forward_ != nullptr) {
+            forward_->flush();
+        }
+    }
+
+    bool matched(size_t pattern) const { return seen_[pattern] != 0; }
+    // The pattern that occurred first, or -1, and the output offset just past it.
+    int first_match() const { return first_match_; }
+    uint64_t first_match_end() const { return first_match_end_; }
+    // Bytes matched so far, up to the stop with stop_at_match.
+    uint64_t scanned() const { return scanned_; }
+    bool stopped() const { return stalls_; }
+
+protected:
+    bool overflow() override {
+        if (stalls_) {
+            return false;
+        }
+        scan_window();
+        return !stalls_;
+    }
+
+private:
+    void scan_window() {
+        const std::string_view bytes(window_.data(), cursor_ - window_.data());
+        const bool finished = patterns_.scan(state_, bytes, [&](size_t pattern, size_t end) {
+            seen_[pattern] = 1;
+            if (first_match_ < 0) {
+                first_match_ = static_cast<int>(pattern);
+                first_match_end_ = scanned_ + end;
+            }
+            return !stop_at_match_;
+        });
+        // After a stop only the bytes up to the end of the match go on.
+        const std::string_view kept = finished ? bytes : bytes.substr(0, first_match_end_ - scanned_);
+        if (forward_ != nullptr) {
+            for (char c : kept) {
+                forward_->put(c);
+            }
+        }
+        if (finished) {
+            scanned_ += bytes.size();
+            cursor_ = window_.data();
+        } else {
+            scanned_ = first_match_end_;
+            // Stalled from here on: the window stays full.
+            stalls_ = true;
+            cursor_ = limit_ = window_.data();
+        }
+    }
+
+    const PatternSet& patterns_;
+    OutputSink* forward_;
+    bool stop_at_match_;
+    std::vector<char> window_;
+    std::vector<uint8_t> seen_;
+    uint32_t state_ = PatternSet::start();
+    uint64_t scanned_ = 0;
+    int first_match_ = -1;
+    uint64_t first_match_end_ = 0;
+};
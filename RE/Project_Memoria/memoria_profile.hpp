@@ -0,0 +1,160 @@
+// Per-opcode profiler for the reference interpreters. Build an interpreter
+// with OpcodeProfile as its profile policy and attach a VmProfile through
+// vm.profile; interpreters built with the default NoProfile contain none of
+// this.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+#include "memoria_vm.hpp"
+#include "memoria_clock.hpp"
+
+inline const char* opcode_name(uint8_t opcode) {
+    switch (opcode) {
+        case 0x01: return "MOV_VAL";
+        case 0x04: return "STORE";
+        case 0x05: return "ADD";
+        case 0x06: return "SUB";
+        case 0x07: return "XOR_REG";
+        case 0x09: return "CMP_MEM";
+        case 0x10: return "CMP_REG";
+        case 0x11: return "JNZ";
+        case 0x12: return "CMP_VAL";
+        case 0x20: return "GETC";
+        case 0x21: return "PUTC";
+        case 0x30: return "GET_TICK";
+        case 0xFE: return "0xFE";
+        case 0xFF: return "HALT";
+        default: return "?";
+    }
+}
+
+// Counters collected across one or more runs. An opcode's cycles run from
+// its fetch to the next fetch (or the end of the run), so they include
+// dispatch and the profiler's own TSC read.
+class VmProfile {
+public:
+    VmProfile() : ip_hits_(65536), ip_opcode_(65536), jnz_taken_(65536), jnz_not_taken_(65536) {}
+
+    void instruction(uint16_t ip, uint8_t opcode) {
+        const uint64_t now = read_cycle_counter();
+        if (pending_) {
+            opcode_cycles_[pending_opcode_] += now - pending_start_;
+        }
+        pending_ = true;
+        pending_opcode_ = opcode;
+        pending_start_ = now;
+        ++opcode_count_[opcode];
+        ++ip_hits_[ip];
+        ip_opcode_[ip] = opcode;
+    }
+
+    void branch(uint16_t ip, bool taken) {
+        ++(taken ? jnz_taken_ : jnz_not_taken_)[ip];
+    }
+
+    void finish() {
+        if (pending_) {
+            opcode_cycles_[pending_opcode_] += read_cycle_counter() - pending_start_;
+            pending_ = false;
+        }
+        ++runs_;
+    }
+
+    uint64_t runs() const { return runs_; }
+    uint64_t opcode_count(uint8_t opcode) const { return opcode_count_[opcode]; }
+    uint64_t opcode_cycles(uint8_t opcode) const { return opcode_cycles_[opcode]; }
+    uint64_t ip_hits(uint16_t ip) const { return ip_hits_[ip]; }
+    uint64_t jnz_taken(uint16_t ip) const { return jnz_taken_[ip]; }
+    uint64_t jnz_not_taken(uint16_t ip) const { return jnz_not_taken_[ip]; }
+
+    void report(std::ostream& out, size_t hot_limit = 16) const {
+        char line[128];
+        uint64_t total_count = 0;
+        uint64_t total_cycles = 0;
+        for (int op = 0; op < 256; ++op) {
+            total_count += opcode_count_[op];
+            total_cycles += opcode_cycles_[op];
+        }
+
+        std::snprintf(line, sizeof(line), "--- VM profile: %llu run(s), %llu instructions, %llu cycles ---\n",
+                      static_cast<unsigned long long>(runs_), static_cast<unsigned long long>(total_count),
+                      static_cast<unsigned long long>(total_cycles));
+        out << line;
+        out << "opcode          count        cycles  cycles/op   share\n";
+        for (int op = 0; op < 256; ++op) {
+            if (opcode_count_[op] == 0) {
+                continue;
+            }
+            std::snprintf(line, sizeof(line), "%-10s %10llu %13llu %10.1f %6.1f%%\n", opcode_name(static_cast<uint8_t>(op)),
+                          static_cast<unsigned long long>(opcode_count_[op]),
+                          static_cast<unsigned long long>(opcode_cycles_[op]),
+                          static_cast<double>(opcode_cycles_[op]) / opcode_count_[op],
+                          total_cycles > 0 ? 100.0 * opcode_cycles_[op] / total_cycles : 0.0);
+            out << line;
+        }
+
+        std::vector<uint16_t> hot;
+        for (size_t ip = 0; ip < ip_hits_.size(); ++ip) {
+            if (ip_hits_[ip] != 0) {
+                hot.push_back(static_cast<uint16_t>(ip));
+            }
+        }
+        std::sort(hot.begin(), hot.end(), [this](uint16_t a, uint16_t b) {
+            return ip_hits_[a] != ip_hits_[b] ? ip_hits_[a] > ip_hits_[b] : a < b;
+        });
+        out << "hot addresses:\n";
+        for (size_t i = 0; i < hot.size() && i < hot_limit; ++i) {
+            std::snprintf(line, sizeof(line), "  0x%04x  %-10s %10llu\n", hot[i], opcode_name(ip_opcode_[hot[i]]),
+                          static_cast<unsigned long long>(ip_hits_[hot[i]]));
+            out << line;
+        }
+
+        out << "JNZ sites:       taken  not taken\n";
+        for (size_t ip = 0; ip < jnz_taken_.size(); ++ip) {
+            if (jnz_taken_[ip] == 0 && jnz_not_taken_[ip] == 0) {
+                continue;
+            }
+            std::snprintf(line, sizeof(line), "  0x%04zx  %10llu %10llu\n", ip,
+                          static_cast<unsigned long long>(jnz_taken_[ip]),
+                          static_cast<unsigned long long>(jnz_not_taken_[ip]));
+            out << line;
+        }
+    }
+
+private:
+    uint64_t opcode_count_[256] = {0};
+    uint64_t opcode_cycles_[256] = {0};
+    std::vector<uint64_t> ip_hits_;
+    std::vector<uint8_t> ip_opcode_;
+    std::vector<uint64_t> jnz_taken_;
+    std::vector<uint64_t> jnz_not_taken_;
+    uint64_t runs_ = 0;
+    bool pending_ = false;
+    uint8_t pending_opcode_ = 0;
+    uint64_t pending_start_ = 0;
+};
+
+// Profile policy: feeds every fetch and JNZ into vm.profile when one is
+// attached.
+struct OpcodeProfile {
+    static void instruction(VirtualMachine& vm, uint16_t ip, uint8_t opcode) {
+        if (vm.profile != nullptr) {
+            vm.profile->instruction(ip, opcode);
+        }
+    }
+    static void branch(VirtualMachine& vm, uint16_t ip, bool taken) {
+        if (vm.profile != nullptr) {
+            vm.profile->branch(ip, taken);
+        }
+    }
+    static void finish(VirtualMachine& vm) {
+        if (vm.profile != nullptr) {
+            vm.profile->finish();
+        }
+    }
+};
@@ -0,0 +1,93 @@
+// Bytecode images shipped with the two programs: the password check run by
+// main.cpp and the four encrypted pieces of the Hakoniwa core program, both
+// assembled at compile time.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "memoria_vm.hpp"
+#include "memoria_image.hpp"
+#include "memoria_asm.hpp"
+
+// Opcodes understood by the VM that runs challenge_bytecode.
+using ChallengeOpcodes = OpcodeSet<0x01, 0x04, 0x06, 0x07, 0x10, 0x11, 0x12, 0x20, 0x21, 0x30, 0xFF>;
+
+// Both programs run the same core: GETC must match CORE_PASSWORD byte by
+// byte, the newline after it must arrive within CORE_TIME_LIMIT_MS of the
+// first GET_TICK, and then every CORE_FLAG_MASKED byte is XORed with
+// CORE_FLAG_MASK and printed.
+inline constexpr char CORE_PASSWORD[] = "CORE-0B-COMPLETE";
+inline constexpr uint32_t CORE_TIME_LIMIT_MS = 500;
+inline constexpr uint8_t CORE_FLAG_MASK = 0x55;
+inline constexpr uint8_t CORE_FLAG_MASKED[] = {
+    0x37, 0x26, 0x36, 0x21, 0x33, 0x2e, 0x01, 0x30, 0x34, 0x27, 0x26, 0x0a, 0x3c, 0x3b, 0x0a, 0x21,
+    0x3d, 0x30, 0x0a, 0x16, 0x3a, 0x31, 0x30, 0x0a, 0x65, 0x17, 0x0a, 0x14, 0x3a, 0x3c, 0x28,
+};
+
+// The shipped images reject a password by jumping to 0x0291, past the end
+// of either program, which stops the VM. It stays a fixed exit address so
+// the bytes players reverse do not change.
+inline constexpr uint16_t CORE_REJECT_ADDRESS = 0x0291;
+
+constexpr void assemble_core(BytecodeAssembler& a) {
+    const AsmLabel reject = a.label();
+    a.bind_exit(reject, CORE_REJECT_ADDRESS);
+
+    a.mov_val(R3, 0);
+    a.get_tick(R0);
+    for (size_t i = 0; i + 1 < sizeof(CORE_PASSWORD); ++i) {
+        a.getc(R1);
+        a.mov_val(R2, static_cast<uint8_t>(CORE_PASSWORD[i]));
+        a.cmp_reg(R1, R2);
+        a.jnz(reject);
+    }
+    a.getc(R1);
+
+    a.get_tick(R1);
+    a.sub(R1, R0);
+    a.cmp_val(R1, CORE_TIME_LIMIT_MS);
+    a.jnz(reject);
+
+    a.mov_val(R0, CORE_FLAG_MASK);
+    for (uint8_t masked : CORE_FLAG_MASKED) {
+        a.mov_val(R1, masked);
+        a.xor_reg(R1, R0);
+        a.putc(R1);
+    }
+}
+
+// main.cpp's program ends by running off the end of the bytecode.
+inline constexpr auto challenge_source = [](BytecodeAssembler& a) { assemble_core(a); };
+inline constexpr auto challenge_bytecode = assemble<assembled_size(challenge_source)>(challenge_source);
+
+// The Hakoniwa core program reports success through 0xFE. It ships
+// XOR-encrypted with HAKONIWA_CHUNK_KEY and split into the pieces unlocked
+// by each story choice.
+const uint8_t HAKONIWA_CHUNK_KEY = 0xAF;
+
+inline constexpr auto hakoniwa_source = [](BytecodeAssembler& a) {
+    assemble_core(a);
+    a.fail();
+    a.halt();
+};
+inline constexpr auto hakoniwa_encrypted =
+    assemble<assembled_size(hakoniwa_source)>(hakoniwa_source, HAKONIWA_CHUNK_KEY);
+
+inline constexpr BytecodeView encrypted_chunk1(hakoniwa_encrypted.data(), 100);
+inline constexpr BytecodeView encrypted_chunk2(hakoniwa_encrypted.data() + 100, 150);
+inline constexpr BytecodeView encrypted_chunk3(hakoniwa_encrypted.data() + 250, 180);
+inline constexpr BytecodeView encrypted_chunk4(hakoniwa_encrypted.data() + 430, hakoniwa_encrypted.size() - 430);
+
+// The pieces in story order, and the size of the whole decrypted program.
+inline constexpr BytecodeView hakoniwa_chunks[] = {encrypted_chunk1, encrypted_chunk2, encrypted_chunk3, encrypted_chunk4};
+inline constexpr size_t HAKONIWA_IMAGE_SIZE = hakoniwa_encrypted.size();
+
+// The complete Hakoniwa program, decrypted into a single allocation.
+inline ProgramImage load_hakoniwa_image() {
+    ProgramImage image(HAKONIWA_IMAGE_SIZE);
+    for (BytecodeView chunk : hakoniwa_chunks) {
+        image.append_decrypted(chunk, HAKONIWA_CHUNK_KEY);
+    }
+    return image;
+}
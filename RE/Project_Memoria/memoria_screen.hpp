@@ -0,0 +1,415 @@
+// Terminal output for the game screens. A FrameBuffer is a grid of cells
+// that text is written into the way a terminal would show it; a
+// TerminalRenderer compares each new frame with the one already on screen
+// and writes only the cells that changed, as one batch of bytes.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "memoria_text.hpp"
+
+// Glyph bytes past `size` are always zero, so equal cells are equal byte
+// for byte and a run of cells compares with one memcmp.
+struct ScreenCell {
+    char glyph[4] = {0, 0, 0, 0};
+    uint8_t size = 0;    // bytes in glyph; 0 for an empty cell or the right half of a wide glyph
+    uint8_t width = 1;   // columns the glyph covers; 0 marks the right half of a wide glyph
+
+    bool operator==(const ScreenCell& other) const { return std::memcmp(this, &other, sizeof(ScreenCell)) == 0; }
+    bool operator!=(const ScreenCell& other) const { return !(*this == other); }
+};
+static_assert(sizeof(ScreenCell) == 6, "ScreenCell rows are compared as raw bytes");
+
+// A frame composed in memory. write() lays text out like a terminal: glyphs
+// advance the cursor by their width and '\n' moves to the start of the next
+// row. Rows are created as text reaches them; anything past `columns` is
+// dropped.
+//
+// Every change stamps its row with a counter, so a renderer that has seen
+// the frame before can skip rows that have not changed since without
+// reading them. The generation identifies the frame's contents across
+// clear() and between FrameBuffers, so stamps are never compared across
+// two different frames.
+class FrameBuffer {
+public:
+    explicit FrameBuffer(int columns) : columns_(columns > 0 ? columns : 1), generation_(new_generation()) {}
+
+    FrameBuffer(const FrameBuffer&) = delete;
+    FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+    void clear() {
+        cells_.clear();
+        row_length_.clear();
+        row_stamp_.clear();
+        cursor_row_ = 0;
+        cursor_col_ = 0;
+        generation_ = new_generation();
+    }
+
+    void write(std::string_view text) {
+        for (size_t i = 0; i < text.size(); ) {
+            if (text[i] == '\n') {
+                ++cursor_row_;
+                cursor_col_ = 0;
+                ++i;
+                continue;
+            }
+            size_t ascii = ascii_run_length(text.data() + i, text.size() - i);
+            if (ascii > 0) {
+                const void* newline = std::memchr(text.data() + i, '\n', ascii);
+                if (newline != nullptr) {
+                    ascii = static_cast<const char*>(newline) - (text.data() + i);
+                }
+                put_ascii(text.data() + i, ascii, 0);
+                i += ascii;
+                continue;
+            }
+            const TextGlyph glyph = next_glyph(text.data() + i, text.size() - i);
+            put_glyph(text.data() + i, glyph.size, glyph.width);
+            i += glyph.size;
+        }
+    }
+
+    void write_repeated(char c, int count) {
+        if (count > 0) {
+            put_ascii(nullptr, static_cast<size_t>(count), c);
+        }
+    }
+
+    int columns() const { return columns_; }
+    int rows() const { return static_cast<int>(row_length_.size()); }
+    int row_length(int row) const { return row_length_[row]; }
+    const ScreenCell& cell(int row, int col) const { return cells_[static_cast<size_t>(row) * columns_ + col]; }
+    const ScreenCell* row_cells(int row) const { return &cells_[static_cast<size_t>(row) * columns_]; }
+    uint64_t generation() const { return generation_; }
+    // The last stamp given out, and the stamp of a row's last change.
+    uint64_t stamp() const { return stamp_; }
+    uint64_t row_stamp(int row) const { return row_stamp_[row]; }
+    int cursor_row() const { return cursor_row_; }
+    int cursor_col() const { return cursor_col_; }
+
+private:
+    static uint64_t new_generation() {
+        static std::atomic<uint64_t> next{0};
+        return ++next;
+    }
+
+    void ensure_cursor_row() {
+        while (cursor_row_ >= rows()) {
+            cells_.resize(cells_.size() + columns_);
+            row_length_.push_back(0);
+            row_stamp_.push_back(++stamp_);
+        }
+    }
+
+    // Single-column glyphs, one per byte of text, or `size` copies of fill
+    // when text is null.
+    void put_ascii(const char* text, size_t size, char fill) {
+        ensure_cursor_row();
+        const size_t room = static_cast<size_t>(columns_ - cursor_col_);
+        const size_t count = size < room ? size : room;
+        ScreenCell* cell = &cells_[static_cast<size_t>(cursor_row_) * columns_ + cursor_col_];
+        row_stamp_[cursor_row_] = ++stamp_;
+        ScreenCell ascii;
+        ascii.size = 1;
+        for (size_t k = 0; k < count; ++k) {
+            ascii.glyph[0] = text != nullptr ? text[k] : fill;
+            cell[k] = ascii;
+        }
+        cursor_col_ += static_cast<int>(count);
+        if (cursor_col_ > row_length_[cursor_row_]) {
+            row_length_[cursor_row_] = cursor_col_;
+        }
+    }
+
+    void put_glyph(const char* glyph, size_t size, int width) {
+        if (cursor_col_ + width > columns_) {
+            return;
+        }
+        ensure_cursor_row();
+        row_stamp_[cursor_row_] = ++stamp_;
+        ScreenCell* row = &cells_[static_cast<size_t>(cursor_row_) * columns_];
+        ScreenCell& cell = row[cursor_col_];
+        cell = ScreenCell();
+        std::memcpy(cell.glyph, glyph, size);
+        cell.size = static_cast<uint8_t>(size);
+        cell.width = static_cast<uint8_t>(width);
+        for (int k = 1; k < width; ++k) {
+            row[cursor_col_ + k] = ScreenCell();
+            row[cursor_col_ + k].width = 0;
+        }
+        cursor_col_ += width;
+        if (cursor_col_ > row_length_[cursor_row_]) {
+            row_length_[cursor_row_] = cursor_col_;
+        }
+    }
+
+    int columns_;
+    std::vector<ScreenCell> cells_;
+    std::vector<int> row_length_;
+    std::vector<uint64_t> row_stamp_;
+    int cursor_row_ = 0;
+    int cursor_col_ = 0;
+    uint64_t generation_;
+    uint64_t stamp_ = 0;
+};
+
+// Appends the frame as text, one line per row, with empty cells as spaces
+// and trailing spaces dropped.
+inline void append_frame_text(const FrameBuffer& frame, std::string& out) {
+    for (int row = 0; row < frame.rows(); ++row) {
+        const size_t start = out.size();
+        for (int col = 0; col < frame.row_length(row); ++col) {
+            const ScreenCell& cell = frame.cell(row, col);
+            if (cell.width == 0) {
+                continue;
+            }
+            if (cell.size == 0) {
+                out += ' ';
+            } else {
+                out.append(cell.glyph, cell.size);
+            }
+        }
+        size_t end = out.size();
+        while (end > start && out[end - 1] == ' ') {
+            --end;
+        }
+        out.resize(end);
+        out += '\n';
+    }
+}
+
+// Keeps the terminal in step with a FrameBuffer. present() diffs the frame
+// against the last one presented, moves the cursor only with relative
+// sequences, and hands the whole update to one write. After reset() the
+// next frame is drawn from the top of the screen over whatever was there.
+//
+// Rows are only ever reached from the row the cursor is on, so frames
+// taller than the terminal still work as long as only the bottom rows
+// change, which is how the game draws.
+class TerminalRenderer {
+public:
+#ifndef _WIN32
+    explicit TerminalRenderer(int fd = STDOUT_FILENO) : fd_(fd) {}
+#endif
+
+    void reset() {
+        front_.clear();
+        front_length_.clear();
+        fresh_ = true;
+    }
+
+    // Builds the update that brings the screen from the last presented
+    // frame to `frame`, records `frame` as presented and returns the bytes.
+    std::string_view update(const FrameBuffer& frame) {
+        out_.clear();
+        if (fresh_) {
+#ifndef _WIN32
+            out_ += "\033[H";
+#endif
+            cursor_row_ = 0;
+            cursor_col_ = 0;
+            screen_rows_ = 1;
+        }
+
+        if (front_columns_ != frame.columns()) {
+            front_.clear();
+            front_length_.clear();
+            front_columns_ = frame.columns();
+            seen_generation_ = 0;
+        }
+
+        // Rows of the frame presented last that have not been written
+        // since are already on screen as they are.
+        const bool seen = !fresh_ && frame.generation() == seen_generation_;
+        for (int row = 0; row < frame.rows(); ++row) {
+            if (row >= static_cast<int>(front_length_.size())) {
+                front_.resize(front_.size() + front_columns_);
+                front_length_.push_back(0);
+            }
+            if (seen && frame.row_stamp(row) <= seen_stamp_) {
+                continue;
+            }
+            update_row(frame, row);
+        }
+        seen_generation_ = frame.generation();
+        seen_stamp_ = frame.stamp();
+        for (int row = frame.rows(); row < static_cast<int>(front_length_.size()); ++row) {
+            if (front_length_[row] > 0) {
+                move_to(row, 0);
+                erase_line_tail(0);
+                front_length_[row] = 0;
+            }
+        }
+
+        move_to(frame.cursor_row(), frame.cursor_col());
+        if (fresh_) {
+#ifndef _WIN32
+            out_ += "\033[J";
+#endif
+            fresh_ = false;
+        }
+        return out_;
+    }
+
+    // update() plus a single write of the result.
+    void present(const FrameBuffer& frame) {
+#ifdef _WIN32
+        if (fresh_) {
+            std::system("cls");
+        }
+#endif
+        const std::string_view bytes = update(frame);
+#ifdef _WIN32
+        std::fwrite(bytes.data(), 1, bytes.size(), stdout);
+        std::fflush(stdout);
+#else
+        const char* p = bytes.data();
+        const char* end = p + bytes.size();
+        while (p < end) {
+            ssize_t n = write(fd_, p, end - p);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            p += n;
+        }
+#endif
+    }
+
+private:
+    ScreenCell& front_cell(int row, int col) { return front_[static_cast<size_t>(row) * front_columns_ + col]; }
+
+    void update_row(const FrameBuffer& frame, int row) {
+        const int length = frame.row_length(row);
+        const int old_length = front_length_[row];
+        const bool repaint = fresh_;   // the screen under a fresh frame is unknown
+
+        // Most rows of most frames are unchanged.
+        if (!repaint && length == old_length &&
+            std::memcmp(frame.row_cells(row), &front_cell(row, 0), sizeof(ScreenCell) * length) == 0) {
+            return;
+        }
+
+        for (int col = 0; col < length; ) {
+            if (!repaint && frame.cell(row, col) == front_cell(row, col)) {
+                ++col;
+                continue;
+            }
+            // Start a changed run on the glyph that covers this column.
+            while (col > 0 && frame.cell(row, col).width == 0) {
+                --col;
+            }
+            move_to(row, col);
+            while (col < length && (repaint || frame.cell(row, col) != front_cell(row, col) ||
+                                    frame.cell(row, col).width == 0)) {
+                const ScreenCell& cell = frame.cell(row, col);
+                if (cell.width == 0) {
+                    front_cell(row, col) = cell;
+                    ++col;
+                    continue;
+                }
+                if (cell.size == 0) {
+                    out_ += ' ';
+                } else {
+                    out_.append(cell.glyph, cell.size);
+                }
+                for (int k = 0; k < cell.width; ++k) {
+                    front_cell(row, col + k) = frame.cell(row, col + k);
+                }
+                col += cell.width;
+                cursor_col_ = col;
+            }
+        }
+
+        if (length < old_length || repaint) {
+            move_to(row, length);
+            erase_line_tail(length);
+        }
+        front_length_[row] = length;
+    }
+
+    // Clears the cursor's row from the cursor to the end of the old content.
+    void erase_line_tail(int from) {
+#ifdef _WIN32
+        const int old_length = front_length_[cursor_row_];
+        for (int col = from; col < old_length; ++col) {
+            out_ += ' ';
+        }
+        cursor_col_ = old_length > from ? old_length : from;
+#else
+        (void)from;
+        out_ += "\033[K";
+#endif
+        for (int col = from; col < front_columns_; ++col) {
+            front_cell(cursor_row_, col) = ScreenCell();
+        }
+    }
+
+    void move_to(int row, int col) {
+        if (row > cursor_row_) {
+            // Rows the terminal already has are reached with cursor-down;
+            // new rows are made with newlines so the screen scrolls.
+            const int existing = screen_rows_ - 1 - cursor_row_;
+            const int down = row - cursor_row_;
+            if (existing > 0) {
+                append_sequence(down < existing ? down : existing, 'B');
+            }
+            for (int k = existing; k < down; ++k) {
+                out_ += "\r\n";
+                cursor_col_ = 0;
+                ++screen_rows_;
+            }
+            cursor_row_ = row;
+        } else if (row < cursor_row_) {
+            append_sequence(cursor_row_ - row, 'A');
+            cursor_row_ = row;
+        }
+        if (col != cursor_col_) {
+            if (col == 0) {
+                out_ += '\r';
+            } else if (col > cursor_col_) {
+                append_sequence(col - cursor_col_, 'C');
+            } else {
+                append_sequence(cursor_col_ - col, 'D');
+            }
+            cursor_col_ = col;
+        }
+    }
+
+    void append_sequence(int count, char command) {
+        if (count <= 0) {
+            return;
+        }
+        out_ += "\033[";
+        if (count > 1) {
+            out_ += std::to_string(count);
+        }
+        out_ += command;
+    }
+
+#ifndef _WIN32
+    int fd_;
+#endif
+    std::vector<ScreenCell> front_;
+    std::vector<int> front_length_;
+    int front_columns_ = 0;
+    int cursor_row_ = 0;
+    int cursor_col_ = 0;
+    int screen_rows_ = 1;   // rows from the frame's top down to the lowest one the cursor has reached
+    bool fresh_ = true;
+    uint64_t seen_generation_ = 0;
+    uint64_t seen_stamp_ = 0;
+    std::string out_;
+};
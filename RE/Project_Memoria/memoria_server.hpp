@@ -0,0 +1,817 @@
+// Many game sessions in one process. SessionServer accepts players on a
+// Unix or TCP socket and multiplexes their sessions on one epoll loop per
+// thread. Each session is an ordinary HakoniwaSession running on its own
+// small stack (a Fiber) against a SocketGameIo, which hands control back
+// to the loop whenever the session would block: waiting for an answer,
+// the next typewriter tick, the end of a pause, or room in the socket.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) && !defined(MEMORIA_DISABLE_SERVER)
+#define MEMORIA_HAS_SERVER 1
+#endif
+
+#ifdef MEMORIA_HAS_SERVER
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "memoria_game.hpp"
+
+// Addresses are "unix:<path>" or "[tcp:]<host>:<port>". An empty host
+// listens on every interface and connects to the local host.
+inline int open_socket(std::string_view address, bool listening, std::string& error) {
+    if (address.substr(0, 5) == "unix:") {
+        const std::string path(address.substr(5));
+        struct sockaddr_un addr {};
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            error = "bad socket path: " + path;
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            error = std::string("socket: ") + std::strerror(errno);
+            return -1;
+        }
+        if (listening) {
+            // A socket file left behind by an earlier server is replaced.
+            struct stat st {};
+            if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(path.c_str());
+            }
+            if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+                error = path + ": " + std::strerror(errno);
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+            error = path + ": " + std::strerror(errno);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (address.substr(0, 4) == "tcp:") {
+        address.remove_prefix(4);
+    }
+    const size_t colon = address.rfind(':');
+    if (colon == std::string_view::npos) {
+        error = "address needs a port: " + std::string(address);
+        return -1;
+    }
+    std::string host(address.substr(0, colon));
+    const std::string port(address.substr(colon + 1));
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    struct addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    struct addrinfo* found = nullptr;
+    const int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+    if (rc != 0) {
+        error = std::string(address) + ": " + gai_strerror(rc);
+        return -1;
+    }
+    int fd = -1;
+    error = std::string(address) + ": no usable address";
+    for (struct addrinfo* ai = found; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        bool ok;
+        if (listening) {
+            const int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0;
+        } else {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (ok) {
+            break;
+        }
+        error = std::string(address) + ": " + std::strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+inline bool set_nonblocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Fibers switch stacks with a few instructions on x86-64. swapcontext()
+// would also save and restore the signal mask, a system call each way,
+// which costs more than most of what a session does between two waits.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(MEMORIA_FIBER_UCONTEXT)
+#define MEMORIA_HAS_STACK_SWITCH 1
+
+// memoria_switch_stack(from, to) pushes the callee-saved registers, stores
+// the stack pointer in *from, and pops the same registers from `to`,
+// returning to wherever that stack last left off. A new stack starts in
+// memoria_fiber_start, which calls r13 with r12 as its argument.
+extern "C" void memoria_switch_stack(void** from, void* to);
+asm(R"(
+    .pushsection .text
+    .weak memoria_switch_stack
+    .type memoria_switch_stack, @function
+memoria_switch_stack:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size memoria_switch_stack, .-memoria_switch_stack
+
+    .weak memoria_fiber_start
+    .type memoria_fiber_start, @function
+memoria_fiber_start:
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .size memoria_fiber_start, .-memoria_fiber_start
+    .popsection
+)");
+extern "C" void memoria_fiber_start();
+#else
+#include <ucontext.h>
+#endif
+
+// A function run on its own stack. resume() runs it until it calls yield()
+// or returns; the next resume() continues from the yield. The stack is
+// mapped with a guard page below it and is only backed by memory as deep
+// as the function actually goes.
+class Fiber {
+public:
+    static constexpr size_t DEFAULT_STACK_SIZE = 256 * 1024;
+
+    explicit Fiber(std::function<void()> body, size_t stack_size = DEFAULT_STACK_SIZE) : body_(std::move(body)) {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        mapped_size_ = (stack_size + page - 1) / page * page + page;
+        void* memory = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (memory == MAP_FAILED) {
+            return;
+        }
+        if (mprotect(memory, page, PROT_NONE) != 0) {
+            munmap(memory, mapped_size_);
+            return;
+        }
+        stack_ = static_cast<char*>(memory);
+#ifdef MEMORIA_HAS_STACK_SWITCH
+        // The frame memoria_switch_stack pops on the first resume: r15, r14,
+        // r13 = run, r12 = this, rbx, rbp, then memoria_fiber_start as the
+        // return address. It sits so that the call to run is 16-byte aligned.
+        void** frame = reinterpret_cast<void**>(stack_ + mapped_size_) - 9;
+        frame[2] = reinterpret_cast<void*>(&Fiber::run);
+        frame[3] = this;
+        frame[6] = reinterpret_cast<void*>(&memoria_fiber_start);
+        fiber_sp_ = frame;
+#else
+        getcontext(&context_);
+        context_.uc_stack.ss_sp = stack_ + page;
+        context_.uc_stack.ss_size = mapped_size_ - page;
+        context_.uc_link = &caller_;
+        // makecontext only passes int arguments, so `this` goes in halves.
+        const uintptr_t self = reinterpret_cast<uintptr_t>(this);
+        makecontext(&context_, reinterpret_cast<void (*)()>(&Fiber::entry), 2,
+                    static_cast<unsigned>(self), static_cast<unsigned>(static_cast<uint64_t>(self) >> 32));
+#endif
+    }
+
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+
+    ~Fiber() {
+        if (stack_ != nullptr) {
+            munmap(stack_, mapped_size_);
+        }
+    }
+
+    bool valid() const { return stack_ != nullptr; }
+    bool finished() const { return finished_; }
+
+    void resume() {
+        if (stack_ == nullptr || finished_) {
+            return;
+        }
+#ifdef MEMORIA_HAS_STACK_SWITCH
+        memoria_switch_stack(&caller_sp_, fiber_sp_);
+#else
+        swapcontext(&caller_, &context_);
+#endif
+    }
+
+    // Only from inside the body.
+    void yield() {
+#ifdef MEMORIA_HAS_STACK_SWITCH
+        memoria_switch_stack(&fiber_sp_, caller_sp_);
+#else
+        swapcontext(&context_, &caller_);
+#endif
+    }
+
+private:
+    static void run(Fiber* fiber) {
+        try {
+            fiber->body_();
+        } catch (...) {
+            // The session is over either way; its connection is closed.
+        }
+        fiber->finished_ = true;
+#ifdef MEMORIA_HAS_STACK_SWITCH
+        fiber->yield();   // never resumed again
+#endif
+    }
+
+#ifndef MEMORIA_HAS_STACK_SWITCH
+    static void entry(unsigned low, unsigned high) {
+        run(reinterpret_cast<Fiber*>(static_cast<uintptr_t>((static_cast<uint64_t>(high) << 32) | low)));
+    }
+#endif
+
+    std::function<void()> body_;
+    char* stack_ = nullptr;
+    size_t mapped_size_ = 0;
+#ifdef MEMORIA_HAS_STACK_SWITCH
+    void* fiber_sp_ = nullptr;
+    void* caller_sp_ = nullptr;
+#else
+    ucontext_t context_ {};
+    ucontext_t caller_ {};
+#endif
+    bool finished_ = false;
+};
+
+// GameIo for a session on a socket, run inside a Fiber. Frames go through
+// a diffing TerminalRenderer into an output buffer that is sent whenever
+// the session is about to wait; the session suspends instead of blocking,
+// and the reactor resumes it once ready() says what it waits for is there.
+//
+// As on a terminal, bytes that arrive during an animation are keypresses
+// that skip it, and bytes that arrive at a prompt are the answer. A peer
+// that stops reading or resets the connection makes every wait return at
+// once, so an abandoned session runs straight to its end.
+class SocketGameIo : public GameIo {
+public:
+    using clock = std::chrono::steady_clock;
+    using clock_time = clock::time_point;
+
+    enum class Wait { None, Input, Event, Timer, Drain };
+
+    // Output queued past this suspends the session until the peer reads.
+    static constexpr size_t OUTPUT_HIGH_WATER = 64 * 1024;
+    // Input past this is dropped; nothing the game reads comes close.
+    static constexpr size_t INPUT_LIMIT = 4 * 1024;
+
+    explicit SocketGameIo(int fd) : fd_(fd), input_(*this) {}
+    SocketGameIo(const SocketGameIo&) = delete;
+    SocketGameIo& operator=(const SocketGameIo&) = delete;
+    ~SocketGameIo() { close(fd_); }
+
+    // `now` is the reactor's loop time, read once per pass of its loop;
+    // timers and ticks go by it rather than reading the clock each time.
+    void attach(Fiber* fiber, const clock_time* now) {
+        fiber_ = fiber;
+        now_ = now;
+    }
+
+    void begin_screen() override { renderer_.reset(); }
+    void present(const FrameBuffer& frame) override { queue(renderer_.update(frame)); }
+    void print(std::string_view text) override { queue(text); }
+
+    void start_ticks(std::chrono::milliseconds period) override {
+        period_ = period.count() > 0 ? period : std::chrono::milliseconds(1);
+        next_tick_ = *now_ + period_;
+        ticking_ = true;
+    }
+    void stop_ticks() override { ticking_ = false; }
+
+    InputEvent wait(std::chrono::milliseconds timeout) override {
+        const bool limited = timeout.count() >= 0;
+        const clock_time deadline = *now_ + (limited ? timeout : std::chrono::milliseconds(0));
+        for (;;) {
+            if (broken_) {
+                return InputEvent{InputEvent::Key, 0};
+            }
+            if (!in_.empty()) {
+                in_.clear();
+                return InputEvent{InputEvent::Key, 0};
+            }
+            const clock_time now = *now_;
+            if (ticking_ && now >= next_tick_) {
+                const uint64_t ticks = 1 + static_cast<uint64_t>((now - next_tick_) / period_);
+                next_tick_ += period_ * ticks;
+                return InputEvent{InputEvent::Tick, ticks};
+            }
+            if (limited && now >= deadline) {
+                return InputEvent{InputEvent::Timeout, 0};
+            }
+            if (!ticking_ && !limited && input_closed_) {
+                return InputEvent{InputEvent::Timeout, 0};
+            }
+            clock_time wake = deadline;
+            if (ticking_ && (!limited || next_tick_ < wake)) {
+                wake = next_tick_;
+            }
+            suspend(Wait::Event, ticking_ || limited, wake);
+        }
+    }
+
+    void sleep(std::chrono::milliseconds duration) override {
+        const clock_time deadline = *now_ + duration;
+        while (!broken_ && *now_ < deadline) {
+            suspend(Wait::Timer, true, deadline);
+        }
+    }
+
+    InputSource& line_input() override { return input_; }
+
+    // Reactor side.
+
+    // Reads everything that has arrived, noting end of input and errors.
+    void receive() {
+        char buffer[4096];
+        for (;;) {
+            const ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                in_.append(buffer, std::min(static_cast<size_t>(n), INPUT_LIMIT - std::min(in_.size(), INPUT_LIMIT)));
+                continue;
+            }
+            if (n == 0) {
+                input_closed_ = true;
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                broken_ = true;
+            }
+            return;
+        }
+    }
+
+    // Sends as much queued output as the socket takes.
+    void flush() {
+        while (sent_ < out_.size() && !broken_) {
+            const ssize_t n = send(fd_, out_.data() + sent_, out_.size() - sent_, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent_ += static_cast<size_t>(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                broken_ = true;
+            }
+        }
+        if (sent_ == out_.size() || broken_) {
+            out_.clear();
+            sent_ = 0;
+        }
+    }
+
+    // The peer is gone in both directions; nothing more can be sent.
+    void disconnect() {
+        broken_ = true;
+        out_.clear();
+        sent_ = 0;
+    }
+
+    // The readiness the reactor should watch the socket for: input until
+    // the peer stops sending, and room to write only while output waits.
+    uint32_t interest() const {
+        uint32_t events = 0;
+        if (!input_closed_ && !broken_) {
+            events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (!out_.empty() && !broken_) {
+            events |= EPOLLOUT;
+        }
+        return events;
+    }
+
+    // Whether the session can make progress on what it is waiting for;
+    // timed waits are resumed by the reactor's timers instead.
+    bool ready() const {
+        switch (waiting_) {
+            case Wait::Input: return !in_.empty() || input_closed_ || broken_;
+            case Wait::Event: return !in_.empty() || broken_;
+            case Wait::Timer: return broken_;
+            case Wait::Drain: return broken_ || out_.size() - sent_ < OUTPUT_HIGH_WATER;
+            case Wait::None: break;
+        }
+        return false;
+    }
+
+    Wait waiting() const { return waiting_; }
+    bool has_deadline() const { return waiting_ != Wait::None && has_deadline_; }
+    clock_time deadline() const { return deadline_; }
+    // Changes with every suspension, so stale timers can be told apart.
+    uint64_t suspension() const { return suspension_; }
+    bool drained() const { return out_.empty() || broken_; }
+
+private:
+    class SocketInput : public InputSource {
+    public:
+        explicit SocketInput(SocketGameIo& io) : io_(io) {}
+
+    protected:
+        // Takes over everything received so far; the reactor keeps
+        // appending to the other buffer while the session reads this one.
+        bool underflow() override {
+            while (io_.in_.empty() && !io_.input_closed_ && !io_.broken_) {
+                io_.suspend(Wait::Input, false, clock_time());
+            }
+            if (io_.in_.empty() || io_.broken_) {
+                return false;
+            }
+            window_.swap(io_.in_);
+            io_.in_.clear();
+            cursor_ = window_.data();
+            limit_ = window_.data() + window_.size();
+            return true;
+        }
+
+    private:
+        SocketGameIo& io_;
+        std::string window_;
+    };
+
+    void queue(std::string_view bytes) {
+        if (broken_) {
+            return;
+        }
+        out_.append(bytes.data(), bytes.size());
+        if (out_.size() - sent_ >= OUTPUT_HIGH_WATER) {
+            flush();
+            while (!broken_ && out_.size() - sent_ >= OUTPUT_HIGH_WATER) {
+                suspend(Wait::Drain, false, clock_time());
+            }
+        }
+    }
+
+    // Sends what is queued, then gives control back to the reactor until
+    // it resumes the session.
+    void suspend(Wait wait, bool has_deadline, clock_time deadline) {
+        flush();
+        if (broken_) {
+            return;
+        }
+        waiting_ = wait;
+        has_deadline_ = has_deadline;
+        deadline_ = deadline;
+        ++suspension_;
+        fiber_->yield();
+        waiting_ = Wait::None;
+    }
+
+    int fd_;
+    Fiber* fiber_ = nullptr;
+    const clock_time* now_ = nullptr;
+    TerminalRenderer renderer_;
+    std::string out_;
+    size_t sent_ = 0;
+    std::string in_;
+    SocketInput input_;
+    bool input_closed_ = false;
+    bool broken_ = false;
+
+    bool ticking_ = false;
+    std::chrono::milliseconds period_{10};
+    clock_time next_tick_ {};
+
+    Wait waiting_ = Wait::None;
+    bool has_deadline_ = false;
+    clock_time deadline_ {};
+    uint64_t suspension_ = 0;
+};
+
+// Counters shared by every reactor thread of a server.
+struct ServerStats {
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> finished{0};
+    std::atomic<uint64_t> authenticated{0};
+    std::atomic<uint64_t> active{0};
+    std::atomic<uint64_t> peak{0};
+};
+
+// One reactor: an epoll loop over the listening socket, a shared stop
+// eventfd and its own sessions. Several reactors can share a listening
+// socket, one per thread; each accepts its own connections. With a
+// session limit, reactors stop accepting once that many sessions have
+// been accepted in total and return when their last session ends.
+class SessionServer {
+public:
+    SessionServer(int listen_fd, int stop_fd, const Story& story, const SessionOptions& options, ServerStats& stats,
+                  uint64_t session_limit = 0)
+        : listen_fd_(listen_fd), stop_fd_(stop_fd), story_(story), options_(options), stats_(stats),
+          session_limit_(session_limit) {}
+
+    SessionServer(const SessionServer&) = delete;
+    SessionServer& operator=(const SessionServer&) = delete;
+
+    ~SessionServer() {
+        connections_.clear();
+        if (epoll_fd_ >= 0) {
+            close(epoll_fd_);
+        }
+    }
+
+    bool run(std::string& error) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            error = std::string("epoll_create1: ") + std::strerror(errno);
+            return false;
+        }
+        struct epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = STOP_ID;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &ev);
+        accepting_ = !limit_reached();
+        if (accepting_) {
+            watch_listener(true);
+        }
+
+        std::vector<struct epoll_event> events(256);
+        while (accepting_ || !connections_.empty()) {
+            const int n = epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()), next_timeout_ms());
+            if (n < 0 && errno != EINTR) {
+                error = std::string("epoll_wait: ") + std::strerror(errno);
+                return false;
+            }
+            now_ = clock::now();
+            for (int i = 0; i < n; ++i) {
+                const uint64_t id = events[i].data.u64;
+                if (id == LISTENER_ID) {
+                    accept_all();
+                } else if (id == STOP_ID) {
+                    stop_accepting();
+                } else {
+                    handle(id, events[i].events);
+                }
+            }
+            run_timers();
+        }
+        return true;
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr uint64_t LISTENER_ID = 0;
+    static constexpr uint64_t STOP_ID = 1;
+
+    struct Connection {
+        Connection(int socket_fd, const Story& story) : fd(socket_fd), io(socket_fd), session(io, story) {}
+
+        int fd;
+        SocketGameIo io;
+        HakoniwaSession session;
+        std::unique_ptr<Fiber> fiber;
+        uint32_t interest = 0;   // what epoll watches the socket for
+        bool done = false;
+    };
+
+    struct Timer {
+        clock::time_point when;
+        uint64_t id;
+        uint64_t suspension;
+        bool operator>(const Timer& other) const { return when > other.when; }
+    };
+
+    bool limit_reached() const { return session_limit_ != 0 && stats_.accepted.load() >= session_limit_; }
+
+    void watch_listener(bool watch) {
+        struct epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.u64 = LISTENER_ID;
+        epoll_ctl(epoll_fd_, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listen_fd_, watch ? &ev : nullptr);
+        listener_watched_ = watch;
+    }
+
+    void stop_accepting() {
+        accepting_ = false;
+        if (listener_watched_) {
+            watch_listener(false);
+        }
+    }
+
+    void accept_all() {
+        while (accepting_) {
+            const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // Out of descriptors or memory: stop listening until a
+                    // session ends rather than spin on the pending connection.
+                    watch_listener(false);
+                }
+                return;
+            }
+            const uint64_t count = stats_.accepted.fetch_add(1) + 1;
+            if (session_limit_ != 0 && count > session_limit_) {
+                stats_.accepted.fetch_sub(1);
+                close(fd);
+                stop_all();
+                return;
+            }
+            open_session(fd);
+            if (session_limit_ != 0 && count == session_limit_) {
+                stop_all();
+            }
+        }
+    }
+
+    void stop_all() {
+        const uint64_t one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero; every reactor wakes anyway.
+        }
+        stop_accepting();
+    }
+
+    void open_session(int fd) {
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // fails harmlessly on Unix sockets
+
+        auto connection = std::make_unique<Connection>(fd, story_);
+        Connection* c = connection.get();
+        c->fiber = std::make_unique<Fiber>([this, c] { c->session.run(options_); });
+        if (!c->fiber->valid()) {
+            return;
+        }
+        c->io.attach(c->fiber.get(), &now_);
+
+        const uint64_t id = next_id_++;
+        struct epoll_event ev {};
+        ev.events = c->interest = c->io.interest();
+        ev.data.u64 = id;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            return;
+        }
+        connections_.emplace(id, std::move(connection));
+
+        const uint64_t active = stats_.active.fetch_add(1) + 1;
+        for (uint64_t peak = stats_.peak.load(); active > peak && !stats_.peak.compare_exchange_weak(peak, active); ) {
+        }
+        resume(id, *c);
+    }
+
+    void handle(uint64_t id, uint32_t events) {
+        auto it = connections_.find(id);
+        if (it == connections_.end()) {
+            return;
+        }
+        Connection& c = *it->second;
+        if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+            c.io.disconnect();
+        }
+        if ((events & (EPOLLIN | EPOLLRDHUP)) != 0) {
+            c.io.receive();
+        }
+        if ((events & EPOLLOUT) != 0) {
+            c.io.flush();
+        }
+        if (c.done) {
+            if (c.io.drained()) {
+                close_connection(it);
+            } else {
+                watch(id, c);
+            }
+        } else if (c.io.ready()) {
+            resume(id, c);
+        } else {
+            watch(id, c);
+        }
+    }
+
+    // Brings the epoll registration in line with what the socket waits for.
+    void watch(uint64_t id, Connection& c) {
+        const uint32_t interest = c.io.interest();
+        if (interest != c.interest) {
+            struct epoll_event ev {};
+            ev.events = interest;
+            ev.data.u64 = id;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+            c.interest = interest;
+        }
+    }
+
+    void resume(uint64_t id, Connection& c) {
+        c.fiber->resume();
+        if (c.fiber->finished()) {
+            c.done = true;
+            stats_.finished.fetch_add(1);
+            if (c.session.authenticated()) {
+                stats_.authenticated.fetch_add(1);
+            }
+            c.io.flush();
+            if (c.io.drained()) {
+                close_connection(connections_.find(id));
+            } else {
+                watch(id, c);
+            }
+            return;
+        }
+        if (c.io.has_deadline()) {
+            // Deadlines are rounded up to the millisecond, the resolution of
+            // epoll_wait(), so sessions due in the same millisecond are all
+            // resumed in one pass of the loop instead of one pass each.
+            const clock::time_point when(
+                std::chrono::ceil<std::chrono::milliseconds>(c.io.deadline().time_since_epoch()));
+            timers_.push(Timer{when, id, c.io.suspension()});
+        }
+        watch(id, c);
+    }
+
+    void close_connection(std::unordered_map<uint64_t, std::unique_ptr<Connection>>::iterator it) {
+        connections_.erase(it);
+        stats_.active.fetch_sub(1);
+        if (accepting_ && !listener_watched_) {
+            watch_listener(true);
+        }
+    }
+
+    void run_timers() {
+        while (!timers_.empty() && timers_.top().when <= now_) {
+            const Timer timer = timers_.top();
+            timers_.pop();
+            auto it = connections_.find(timer.id);
+            if (it == connections_.end() || it->second->done || it->second->io.suspension() != timer.suspension ||
+                it->second->io.waiting() == SocketGameIo::Wait::None) {
+                continue;   // the session has moved on since this timer was set
+            }
+            resume(timer.id, *it->second);
+        }
+    }
+
+    int next_timeout_ms() const {
+        if (timers_.empty()) {
+            return -1;
+        }
+        const auto left = timers_.top().when - clock::now();
+        return left.count() <= 0 ? 0 : static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+
+    int listen_fd_;
+    int stop_fd_;
+    const Story& story_;
+    SessionOptions options_;
+    ServerStats& stats_;
+    uint64_t session_limit_;
+
+    int epoll_fd_ = -1;
+    clock::time_point now_ = clock::now();
+    bool accepting_ = false;
+    bool listener_watched_ = false;
+    uint64_t next_id_ = STOP_ID + 1;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+};
+#endif
@@ -0,0 +1,164 @@
+// Where a game session meets the outside world. The story flow draws
+// frames, prints prompts, animates on ticks and reads answers only through
+// GameIo; TerminalGameIo is the interactive game on a TTY, HeadlessGameIo
+// plays the same session from a script in memory with virtual time.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "memoria_vm.hpp"
+#include "memoria_screen.hpp"
+#include "memoria_events.hpp"
+
+class GameIo {
+public:
+    virtual ~GameIo() = default;
+
+    // The next present() draws a new screen from the top.
+    virtual void begin_screen() = 0;
+    virtual void present(const FrameBuffer& frame) = 0;
+    // Text written after the frame: prompts, VM output, closing lines.
+    virtual void print(std::string_view text) = 0;
+
+    // Animation: a periodic tick plus keypresses, as in EventLoop.
+    virtual void start_ticks(std::chrono::milliseconds period) = 0;
+    virtual void stop_ticks() = 0;
+    virtual InputEvent wait(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) = 0;
+    virtual void sleep(std::chrono::milliseconds duration) = 0;
+
+    // Where answers and the password are read from, a character at a time.
+    virtual InputSource& line_input() = 0;
+};
+
+// The game on the controlling terminal: frames go through a diffing
+// TerminalRenderer, keys and ticks through an EventLoop, and prompts read
+// std::cin. The terminal is raw while a screen is up and back in line mode
+// whenever a prompt reads.
+class TerminalGameIo : public GameIo {
+public:
+    void begin_screen() override {
+        std::cout << std::flush;
+        renderer_.reset();
+        mode_.enter_raw();
+    }
+    void present(const FrameBuffer& frame) override { renderer_.present(frame); }
+    void print(std::string_view text) override { std::cout << text; }
+
+    void start_ticks(std::chrono::milliseconds period) override { events_.start_ticks(period); }
+    void stop_ticks() override { events_.stop_ticks(); }
+    InputEvent wait(std::chrono::milliseconds timeout) override { return events_.wait(timeout); }
+    void sleep(std::chrono::milliseconds duration) override {
+        std::cout << std::flush;
+        std::this_thread::sleep_for(duration);
+    }
+
+    InputSource& line_input() override {
+        mode_.leave_raw();
+        return stdin_;
+    }
+
+private:
+    TerminalRenderer renderer_;
+    TerminalMode mode_;
+    EventLoop events_;
+    StdinInput stdin_;
+};
+
+// A session with no terminal. Prompts and the password read from a script
+// owned by the caller (the bytes a player would type, newlines included),
+// no key is ever pressed, and every tick, pause and sleep only moves a
+// virtual clock, so a whole playthrough runs as fast as it can be drawn.
+// Presented frames are not rendered; with record_screens each screen is
+// written into the transcript as it stood when text was first printed
+// after it, when the next screen began, or at finish().
+class HeadlessGameIo : public GameIo {
+public:
+    explicit HeadlessGameIo(std::string_view script = std::string_view(), bool record_screens = false)
+        : script_(script), record_screens_(record_screens) {}
+
+    // Starts over with a new script, keeping the buffers.
+    void reset(std::string_view script) {
+        script_.reset(script);
+        transcript_.clear();
+        last_frame_ = nullptr;
+        unrecorded_ = false;
+        presents_ = 0;
+        now_ = std::chrono::milliseconds(0);
+        ticking_ = false;
+    }
+
+    void begin_screen() override { record_screen(); }
+    void present(const FrameBuffer& frame) override {
+        last_frame_ = &frame;
+        unrecorded_ = true;
+        ++presents_;
+    }
+    void print(std::string_view text) override {
+        record_screen();
+        transcript_.append(text.data(), text.size());
+    }
+
+    void start_ticks(std::chrono::milliseconds period) override {
+        period_ = period.count() > 0 ? period : std::chrono::milliseconds(1);
+        next_tick_ = now_ + period_;
+        ticking_ = true;
+    }
+    void stop_ticks() override { ticking_ = false; }
+
+    // Jumps the clock to whichever comes first, the next tick or the
+    // timeout. With neither there is nothing left to wait for, and it
+    // returns a timeout at once.
+    InputEvent wait(std::chrono::milliseconds timeout) override {
+        const bool limited = timeout.count() >= 0;
+        if (ticking_ && (!limited || next_tick_ <= now_ + timeout)) {
+            now_ = next_tick_;
+            next_tick_ += period_;
+            return InputEvent{InputEvent::Tick, 1};
+        }
+        if (limited) {
+            now_ += timeout;
+        }
+        return InputEvent{InputEvent::Timeout, 0};
+    }
+    void sleep(std::chrono::milliseconds duration) override { now_ += duration; }
+
+    InputSource& line_input() override { return script_; }
+
+    // Records the screen left up at the end of the session.
+    void finish() { record_screen(); }
+
+    // Everything printed, with recorded screens in place between
+    // "--- screen ---" and "--- end screen ---" lines.
+    const std::string& transcript() const { return transcript_; }
+    std::chrono::milliseconds elapsed() const { return now_; }
+    uint64_t presents() const { return presents_; }
+    size_t script_consumed() const { return script_.consumed(); }
+
+private:
+    void record_screen() {
+        if (!record_screens_ || !unrecorded_) {
+            return;
+        }
+        unrecorded_ = false;
+        transcript_ += "--- screen ---\n";
+        append_frame_text(*last_frame_, transcript_);
+        transcript_ += "--- end screen ---\n";
+    }
+
+    SpanInput script_;
+    bool record_screens_;
+    std::string transcript_;
+    const FrameBuffer* last_frame_ = nullptr;
+    bool unrecorded_ = false;   // last_frame_ was presented since it was last recorded
+    uint64_t presents_ = 0;
+    std::chrono::milliseconds now_{0};
+    std::chrono::milliseconds period_{10};
+    std::chrono::milliseconds next_tick_{0};
+    bool ticking_ = false;
+};
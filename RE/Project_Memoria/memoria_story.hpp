@@ -0,0 +1,536 @@
+// Story files: the scenes, art, dialogue and choices of a game together
+// with the encrypted bytecode each choice unlocks, in one compact binary
+// image. Story reads an image in place, usually a read-only mapping of the
+// file, and hands out string_views and BytecodeViews into it, so loading a
+// story is one validation pass and no copies. StoryWriter builds images.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "memoria_vm.hpp"
+
+// Layout, version 1. Every field is a uint32_t in host byte order, as the
+// bytecode's immediates are. The header is followed by four sections, each
+// an array of fixed-size records or raw bytes:
+//   scenes   StorySceneRecord[scene_count]
+//   choices  StoryChoiceRecord[choice_count], each scene's choices adjacent
+//   lines    StoryLineRecord[line_count], one speaker and text per line
+//   text     every string, UTF-8 with no terminators, shared by reference
+//   code     the encrypted bytecode fragments
+// Strings and fragments are (offset, size) pairs into the text and code
+// sections; runs of lines and choices are (first, count) pairs.
+inline constexpr char STORY_MAGIC[8] = {'M', 'E', 'M', 'S', 'T', 'O', 'R', 'Y'};
+inline constexpr uint32_t STORY_VERSION = 1;
+
+// Choice targets that are not scenes.
+inline constexpr uint32_t STORY_NEXT_ACCESS = 0xFFFFFFFE;    // on to the password prompt
+inline constexpr uint32_t STORY_NEXT_BAD_END = 0xFFFFFFFF;   // the session ends here
+
+// Choices are answered with a letter, so a scene has at most 26.
+inline constexpr uint32_t STORY_MAX_CHOICES = 26;
+
+struct StorySpan {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+};
+
+struct StoryRange {
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+struct StoryFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t file_size;
+    uint32_t scene_count, scenes_offset;
+    uint32_t choice_count, choices_offset;
+    uint32_t line_count, lines_offset;
+    uint32_t text_size, text_offset;
+    uint32_t code_size, code_offset;
+    // Fragments are decrypted with `key` (repeating, restarting for each
+    // fragment) into a program of at most program_capacity bytes; any
+    // fragment that would overflow it is dropped.
+    StorySpan key;
+    uint32_t program_capacity;
+    // The password screen, and the marker in the VM's output that means
+    // the password was accepted.
+    StorySpan access_art;
+    StorySpan access_title;
+    StorySpan success_marker;
+    // Shown after an accepted password, and after a rejected one.
+    StorySpan epilogue_art;
+    StoryRange epilogue_lines;
+    StorySpan failure_art;
+    StoryRange failure_lines;
+};
+
+struct StorySceneRecord {
+    StorySpan art;
+    StoryRange lines;
+    StoryRange choices;
+};
+
+// The response to a choice is drawn with `art`, or the scene's art when
+// that is empty; then the fragment is added and the story goes to `next`.
+struct StoryChoiceRecord {
+    StorySpan text;
+    StorySpan art;
+    StoryRange response;
+    StorySpan fragment;
+    uint32_t next;
+};
+
+struct StoryLineRecord {
+    StorySpan speaker;
+    StorySpan text;
+};
+
+// A validated story image. The bytes are not owned and must outlive the
+// Story and every view taken from it. Scene 0 is where a session starts.
+class Story {
+public:
+    struct Line {
+        std::string_view speaker;
+        std::string_view text;
+    };
+
+    // A run of dialogue lines, read from the image as they are visited.
+    class Lines {
+    public:
+        class iterator {
+        public:
+            iterator(const Story* story, uint32_t index) : story_(story), index_(index) {}
+            Line operator*() const { return story_->line(index_); }
+            iterator& operator++() { ++index_; return *this; }
+            bool operator!=(const iterator& other) const { return index_ != other.index_; }
+
+        private:
+            const Story* story_;
+            uint32_t index_;
+        };
+
+        Lines() = default;
+        Lines(const Story* story, StoryRange range) : story_(story), range_(range) {}
+
+        size_t size() const { return range_.count; }
+        bool empty() const { return range_.count == 0; }
+        Line operator[](size_t i) const { return story_->line(range_.first + static_cast<uint32_t>(i)); }
+        iterator begin() const { return iterator(story_, range_.first); }
+        iterator end() const { return iterator(story_, range_.first + range_.count); }
+
+    private:
+        const Story* story_ = nullptr;
+        StoryRange range_;
+    };
+
+    struct Choice {
+        std::string_view text;
+        std::string_view art;
+        Lines response;
+        BytecodeView fragment;
+        uint32_t next;
+    };
+
+    struct Scene {
+        std::string_view art;
+        Lines lines;
+        StoryRange choices;
+    };
+
+    // Checks every header field, record, string and reference against the
+    // image. On failure the Story is left empty and `error` says why.
+    bool load(std::string_view image, std::string& error);
+
+    bool loaded() const { return base_ != nullptr; }
+
+    uint32_t scene_count() const { return header_.scene_count; }
+    Scene scene(uint32_t index) const {
+        const StorySceneRecord r = record<StorySceneRecord>(header_.scenes_offset, index);
+        return Scene{text(r.art), Lines(this, r.lines), r.choices};
+    }
+    // The i-th choice of a scene, labelled 'A' + i.
+    Choice choice(const Scene& scene, size_t i) const {
+        const StoryChoiceRecord r = record<StoryChoiceRecord>(header_.choices_offset, scene.choices.first + static_cast<uint32_t>(i));
+        return Choice{text(r.text), text(r.art), Lines(this, r.response), code(r.fragment), r.next};
+    }
+    Line line(uint32_t index) const {
+        const StoryLineRecord r = record<StoryLineRecord>(header_.lines_offset, index);
+        return Line{text(r.speaker), text(r.text)};
+    }
+
+    BytecodeView key() const { return code_bytes(header_.text_offset + header_.key.offset, header_.key.size); }
+    size_t program_capacity() const { return header_.program_capacity; }
+
+    std::string_view access_art() const { return text(header_.access_art); }
+    std::string_view access_title() const { return text(header_.access_title); }
+    std::string_view success_marker() const { return text(header_.success_marker); }
+    std::string_view epilogue_art() const { return text(header_.epilogue_art); }
+    Lines epilogue_lines() const { return Lines(this, header_.epilogue_lines); }
+    std::string_view failure_art() const { return text(header_.failure_art); }
+    Lines failure_lines() const { return Lines(this, header_.failure_lines); }
+
+    size_t image_size() const { return header_.file_size; }
+
+private:
+    template <class Record>
+    Record record(uint32_t section_offset, uint32_t index) const {
+        Record r;
+        std::memcpy(&r, base_ + section_offset + static_cast<size_t>(index) * sizeof(Record), sizeof(Record));
+        return r;
+    }
+    std::string_view text(StorySpan span) const {
+        return std::string_view(base_ + header_.text_offset + span.offset, span.size);
+    }
+    BytecodeView code(StorySpan span) const { return code_bytes(header_.code_offset + span.offset, span.size); }
+    BytecodeView code_bytes(size_t offset, size_t size) const {
+        return BytecodeView(reinterpret_cast<const uint8_t*>(base_) + offset, size);
+    }
+
+    const char* base_ = nullptr;
+    StoryFileHeader header_ {};
+};
+
+inline bool Story::load(std::string_view image, std::string& error) {
+    base_ = nullptr;
+    header_ = StoryFileHeader{};
+
+    StoryFileHeader h;
+    if (image.size() < sizeof(h)) {
+        error = "story file is too short";
+        return false;
+    }
+    std::memcpy(&h, image.data(), sizeof(h));
+    if (std::memcmp(h.magic, STORY_MAGIC, sizeof(STORY_MAGIC)) != 0) {
+        error = "not a story file";
+        return false;
+    }
+    if (h.version != STORY_VERSION) {
+        error = "unsupported story file version " + std::to_string(h.version);
+        return false;
+    }
+    if (h.file_size != image.size()) {
+        error = "story file is " + std::to_string(image.size()) + " bytes, header says " + std::to_string(h.file_size);
+        return false;
+    }
+
+    auto section_fits = [&](const char* name, uint64_t offset, uint64_t count, uint64_t record_size) {
+        if (offset + count * record_size <= image.size()) {
+            return true;
+        }
+        error = std::string(name) + " section runs past the end of the file";
+        return false;
+    };
+    if (!section_fits("scene", h.scenes_offset, h.scene_count, sizeof(StorySceneRecord)) ||
+        !section_fits("choice", h.choices_offset, h.choice_count, sizeof(StoryChoiceRecord)) ||
+        !section_fits("line", h.lines_offset, h.line_count, sizeof(StoryLineRecord)) ||
+        !section_fits("text", h.text_offset, h.text_size, 1) ||
+        !section_fits("code", h.code_offset, h.code_size, 1)) {
+        return false;
+    }
+
+    auto span_fits = [&](StorySpan span, uint32_t limit, const std::string& what) {
+        if (static_cast<uint64_t>(span.offset) + span.size <= limit) {
+            return true;
+        }
+        error = what + " lies outside its section";
+        return false;
+    };
+    auto range_fits = [&](StoryRange range, uint32_t limit, const std::string& what) {
+        if (static_cast<uint64_t>(range.first) + range.count <= limit) {
+            return true;
+        }
+        error = what + " refers past the last record";
+        return false;
+    };
+    auto record_at = [&](uint32_t section_offset, uint32_t index, auto& r) {
+        std::memcpy(&r, image.data() + section_offset + static_cast<size_t>(index) * sizeof(r), sizeof(r));
+    };
+
+    if (h.scene_count == 0) {
+        error = "story has no scenes";
+        return false;
+    }
+    if (h.program_capacity > 0xFFFF) {
+        error = "program capacity does not fit in the 16-bit address space";
+        return false;
+    }
+    if (!span_fits(h.key, h.text_size, "key") || !span_fits(h.access_art, h.text_size, "access art") ||
+        !span_fits(h.access_title, h.text_size, "access title") ||
+        !span_fits(h.success_marker, h.text_size, "success marker") ||
+        !span_fits(h.epilogue_art, h.text_size, "epilogue art") ||
+        !range_fits(h.epilogue_lines, h.line_count, "epilogue") ||
+        !span_fits(h.failure_art, h.text_size, "failure art") ||
+        !range_fits(h.failure_lines, h.line_count, "failure screen")) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h.line_count; ++i) {
+        StoryLineRecord r;
+        record_at(h.lines_offset, i, r);
+        const std::string what = "line " + std::to_string(i);
+        if (!span_fits(r.speaker, h.text_size, what + " speaker") || !span_fits(r.text, h.text_size, what + " text")) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.choice_count; ++i) {
+        StoryChoiceRecord r;
+        record_at(h.choices_offset, i, r);
+        const std::string what = "choice " + std::to_string(i);
+        if (!span_fits(r.text, h.text_size, what + " text") || !span_fits(r.art, h.text_size, what + " art") ||
+            !range_fits(r.response, h.line_count, what + " response") ||
+            !span_fits(r.fragment, h.code_size, what + " fragment")) {
+            return false;
+        }
+        if (r.next >= h.scene_count && r.next != STORY_NEXT_ACCESS && r.next != STORY_NEXT_BAD_END) {
+            error = what + " leads to missing scene " + std::to_string(r.next);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < h.scene_count; ++i) {
+        StorySceneRecord r;
+        record_at(h.scenes_offset, i, r);
+        const std::string what = "scene " + std::to_string(i);
+        if (!span_fits(r.art, h.text_size, what + " art") || !range_fits(r.lines, h.line_count, what + " dialogue") ||
+            !range_fits(r.choices, h.choice_count, what + " choices")) {
+            return false;
+        }
+        if (r.choices.count == 0 || r.choices.count > STORY_MAX_CHOICES) {
+            error = what + " has " + std::to_string(r.choices.count) + " choices";
+            return false;
+        }
+    }
+
+    base_ = image.data();
+    header_ = h;
+    return true;
+}
+
+// Dialogue as authored: speaker and text.
+using DialogueList = std::vector<std::pair<std::string, std::string>>;
+
+// Builds a story image. Scenes are numbered in the order they are added,
+// starting at 0; choices can lead to scenes that are added later. Equal
+// strings are stored once.
+class StoryWriter {
+public:
+    uint32_t add_scene(std::string_view art, const DialogueList& lines) {
+        scenes_.push_back(SceneSource{std::string(art), lines, {}});
+        return static_cast<uint32_t>(scenes_.size() - 1);
+    }
+
+    // `fragment` is stored as given, already encrypted with the story key.
+    void add_choice(uint32_t scene, std::string_view text, std::string_view art, const DialogueList& response,
+                    BytecodeView fragment, uint32_t next) {
+        scenes_[scene].choices.push_back(ChoiceSource{std::string(text), std::string(art), response,
+                                                      std::string(reinterpret_cast<const char*>(fragment.data()), fragment.size()),
+                                                      next});
+    }
+
+    void set_key(std::string_view key) { key_ = key; }
+    void set_program_capacity(size_t capacity) { program_capacity_ = capacity; }
+    void set_access(std::string_view art, std::string_view title, std::string_view success_marker) {
+        access_art_ = art;
+        access_title_ = title;
+        success_marker_ = success_marker;
+    }
+    void set_epilogue(std::string_view art, const DialogueList& lines) {
+        epilogue_art_ = art;
+        epilogue_lines_ = lines;
+    }
+    void set_failure(std::string_view art, const DialogueList& lines) {
+        failure_art_ = art;
+        failure_lines_ = lines;
+    }
+
+    std::string finish() const;
+
+private:
+    struct ChoiceSource {
+        std::string text;
+        std::string art;
+        DialogueList response;
+        std::string fragment;
+        uint32_t next;
+    };
+    struct SceneSource {
+        std::string art;
+        DialogueList lines;
+        std::vector<ChoiceSource> choices;
+    };
+
+    std::vector<SceneSource> scenes_;
+    std::string key_;
+    size_t program_capacity_ = 0;
+    std::string access_art_, access_title_, success_marker_;
+    std::string epilogue_art_, failure_art_;
+    DialogueList epilogue_lines_, failure_lines_;
+};
+
+inline std::string StoryWriter::finish() const {
+    std::string text;
+    std::unordered_map<std::string, StorySpan> interned;
+    auto add_text = [&](const std::string& s) {
+        auto it = interned.find(s);
+        if (it != interned.end()) {
+            return it->second;
+        }
+        const StorySpan span{static_cast<uint32_t>(text.size()), static_cast<uint32_t>(s.size())};
+        text += s;
+        interned.emplace(s, span);
+        return span;
+    };
+
+    std::vector<StoryLineRecord> lines;
+    auto add_lines = [&](const DialogueList& dialogue) {
+        const StoryRange range{static_cast<uint32_t>(lines.size()), static_cast<uint32_t>(dialogue.size())};
+        for (const auto& p : dialogue) {
+            lines.push_back(StoryLineRecord{add_text(p.first), add_text(p.second)});
+        }
+        return range;
+    };
+
+    std::string code;
+    std::vector<StorySceneRecord> scenes;
+    std::vector<StoryChoiceRecord> choices;
+    for (const SceneSource& scene : scenes_) {
+        StorySceneRecord s;
+        s.art = add_text(scene.art);
+        s.lines = add_lines(scene.lines);
+        s.choices = StoryRange{static_cast<uint32_t>(choices.size()), static_cast<uint32_t>(scene.choices.size())};
+        scenes.push_back(s);
+        for (const ChoiceSource& choice : scene.choices) {
+            StoryChoiceRecord c;
+            c.text = add_text(choice.text);
+            c.art = add_text(choice.art);
+            c.response = add_lines(choice.response);
+            c.fragment = StorySpan{static_cast<uint32_t>(code.size()), static_cast<uint32_t>(choice.fragment.size())};
+            code += choice.fragment;
+            c.next = choice.next;
+            choices.push_back(c);
+        }
+    }
+
+    StoryFileHeader h {};
+    std::memcpy(h.magic, STORY_MAGIC, sizeof(STORY_MAGIC));
+    h.version = STORY_VERSION;
+    h.key = add_text(key_);
+    h.program_capacity = static_cast<uint32_t>(program_capacity_);
+    h.access_art = add_text(access_art_);
+    h.access_title = add_text(access_title_);
+    h.success_marker = add_text(success_marker_);
+    h.epilogue_art = add_text(epilogue_art_);
+    h.epilogue_lines = add_lines(epilogue_lines_);
+    h.failure_art = add_text(failure_art_);
+    h.failure_lines = add_lines(failure_lines_);
+
+    h.scene_count = static_cast<uint32_t>(scenes.size());
+    h.choice_count = static_cast<uint32_t>(choices.size());
+    h.line_count = static_cast<uint32_t>(lines.size());
+    h.text_size = static_cast<uint32_t>(text.size());
+    h.code_size = static_cast<uint32_t>(code.size());
+    h.scenes_offset = sizeof(h);
+    h.choices_offset = h.scenes_offset + h.scene_count * static_cast<uint32_t>(sizeof(StorySceneRecord));
+    h.lines_offset = h.choices_offset + h.choice_count * static_cast<uint32_t>(sizeof(StoryChoiceRecord));
+    h.text_offset = h.lines_offset + h.line_count * static_cast<uint32_t>(sizeof(StoryLineRecord));
+    h.code_offset = h.text_offset + h.text_size;
+    h.file_size = h.code_offset + h.code_size;
+
+    std::string image;
+    image.reserve(h.file_size);
+    image.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    image.append(reinterpret_cast<const char*>(scenes.data()), scenes.size() * sizeof(StorySceneRecord));
+    image.append(reinterpret_cast<const char*>(choices.data()), choices.size() * sizeof(StoryChoiceRecord));
+    image.append(reinterpret_cast<const char*>(lines.data()), lines.size() * sizeof(StoryLineRecord));
+    image += text;
+    image += code;
+    return image;
+}
+
+// A whole file, read-only. On POSIX systems it is mapped, so opening costs
+// no copy and pages are read in as they are touched; elsewhere it is read
+// into memory.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const char* path, std::string& error) {
+        close();
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            error = std::string("cannot open ") + path;
+            return false;
+        }
+        contents_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data_ = contents_.data();
+        size_ = contents_.size();
+#else
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::string("cannot open ") + path;
+            return false;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            error = std::string("cannot stat ") + path;
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* memory = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (memory == MAP_FAILED) {
+                ::close(fd);
+                size_ = 0;
+                error = std::string("cannot map ") + path;
+                return false;
+            }
+            data_ = static_cast<const char*>(memory);
+        }
+        ::close(fd);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        contents_.clear();
+#else
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    std::string_view bytes() const { return std::string_view(data_, size_); }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    std::string contents_;
+#endif
+};
@@ -0,0 +1,278 @@
+// Display width and line wrapping for the dialogue box. Widths come from a
+// table of East Asian Wide and Fullwidth ranges; runs of ASCII are measured
+// sixteen bytes at a time, and wrap_text() makes one pass over the text,
+// keeping each line's width as it goes so nothing is measured twice.
+// LayoutCache keeps the finished layouts of text that is drawn again.
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#define MEMORIA_HAS_SIMD_ASCII 1
+#include <emmintrin.h>
+#endif
+
+// Bytes in the UTF-8 sequence starting with `lead`; stray continuation
+// bytes count as one-byte glyphs.
+inline size_t utf8_glyph_size(unsigned char lead) {
+    if (lead < 0x80) return 1;
+    if ((lead & 0xE0) == 0xC0) return 2;
+    if ((lead & 0xF0) == 0xE0) return 3;
+    if ((lead & 0xF8) == 0xF0) return 4;
+    return 1;
+}
+
+// Bytes of `text` before the first non-ASCII byte (size if there is none).
+inline size_t ascii_run_length(const char* text, size_t size) {
+    size_t i = 0;
+#ifdef MEMORIA_HAS_SIMD_ASCII
+    for (; i + 16 <= size; i += 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        const int high_bits = _mm_movemask_epi8(block);
+        if (high_bits != 0) {
+            return i + __builtin_ctz(static_cast<unsigned>(high_bits));
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (static_cast<unsigned char>(text[i]) >= 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Code points that take two columns: East Asian Wide and Fullwidth from
+// Unicode 14, with runs of unassigned code points between wide ranges
+// folded in, and the curly quotes, which the game has always drawn wide.
+// Sorted and disjoint.
+struct WideRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+inline constexpr WideRange WIDE_RANGES[] = {
+    {0x01100, 0x0115F}, {0x02018, 0x02019}, {0x0201C, 0x0201D}, {0x0231A, 0x0231B},
+    {0x02329, 0x0232A}, {0x023E9, 0x023EC}, {0x023F0, 0x023F0}, {0x023F3, 0x023F3},
+    {0x025FD, 0x025FE}, {0x02614, 0x02615}, {0x02648, 0x02653}, {0x0267F, 0x0267F},
+    {0x02693, 0x02693}, {0x026A1, 0x026A1}, {0x026AA, 0x026AB}, {0x026BD, 0x026BE},
+    {0x026C4, 0x026C5}, {0x026CE, 0x026CE}, {0x026D4, 0x026D4}, {0x026EA, 0x026EA},
+    {0x026F2, 0x026F3}, {0x026F5, 0x026F5}, {0x026FA, 0x026FA}, {0x026FD, 0x026FD},
+    {0x02705, 0x02705}, {0x0270A, 0x0270B}, {0x02728, 0x02728}, {0x0274C, 0x0274C},
+    {0x0274E, 0x0274E}, {0x02753, 0x02755}, {0x02757, 0x02757}, {0x02795, 0x02797},
+    {0x027B0, 0x027B0}, {0x027BF, 0x027BF}, {0x02B1B, 0x02B1C}, {0x02B50, 0x02B50},
+    {0x02B55, 0x02B55}, {0x02E80, 0x0303E}, {0x03041, 0x03247}, {0x03250, 0x04DBF},
+    {0x04E00, 0x0A4C6}, {0x0A960, 0x0A97C}, {0x0AC00, 0x0D7A3}, {0x0F900, 0x0FAD9},
+    {0x0FE10, 0x0FE19}, {0x0FE30, 0x0FE6B}, {0x0FF01, 0x0FF60}, {0x0FFE0, 0x0FFE6},
+    {0x16FE0, 0x1B2FB}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C},
+    {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+    {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+    {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A},
+    {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5},
+    {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6DF}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+    {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAF6}, {0x20000, 0x3FFFD},
+};
+
+inline int codepoint_display_width(uint32_t codepoint) {
+    if (codepoint < WIDE_RANGES[0].first) {
+        return 1;
+    }
+    const WideRange* range = std::upper_bound(std::begin(WIDE_RANGES), std::end(WIDE_RANGES), codepoint,
+        [](uint32_t value, const WideRange& r) { return value < r.first; });
+    return codepoint <= range[-1].last ? 2 : 1;
+}
+
+// Columns one glyph of `size` bytes covers. Only three- and four-byte
+// sequences can be wide; everything else, including stray bytes, is one
+// column.
+inline int glyph_display_width(const char* glyph, size_t size) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(glyph);
+    uint32_t codepoint;
+    if (size == 3) {
+        codepoint = ((bytes[0] & 0x0Fu) << 12) | ((bytes[1] & 0x3Fu) << 6) | (bytes[2] & 0x3Fu);
+    } else if (size == 4) {
+        codepoint = ((bytes[0] & 0x07u) << 18) | ((bytes[1] & 0x3Fu) << 12) | ((bytes[2] & 0x3Fu) << 6) |
+                    (bytes[3] & 0x3Fu);
+    } else {
+        return 1;
+    }
+    return codepoint_display_width(codepoint);
+}
+
+struct TextGlyph {
+    size_t size;   // bytes
+    int width;     // columns
+};
+
+// The glyph at the start of `text` (size > 0). A sequence cut short by the
+// end of the text is one narrow glyph made of the bytes that are there.
+inline TextGlyph next_glyph(const char* text, size_t size) {
+    const size_t glyph_size = utf8_glyph_size(static_cast<unsigned char>(text[0]));
+    if (glyph_size > size) {
+        return TextGlyph{size, 1};
+    }
+    return TextGlyph{glyph_size, glyph_display_width(text, glyph_size)};
+}
+
+inline int display_width(std::string_view text) {
+    size_t width = 0;
+    for (size_t i = 0; i < text.size(); ) {
+        const size_t ascii = ascii_run_length(text.data() + i, text.size() - i);
+        width += ascii;
+        i += ascii;
+        if (i < text.size()) {
+            const TextGlyph glyph = next_glyph(text.data() + i, text.size() - i);
+            width += glyph.width;
+            i += glyph.size;
+        }
+    }
+    return static_cast<int>(width);
+}
+
+struct TextLine {
+    std::string text;
+    int width = 0;
+    int padding = 0;   // spaces that fill the line out to the width it was laid out for
+};
+
+// Breaks text into lines of at most max_width columns (a glyph wider than
+// that still gets a line of its own, with no padding). Text with any non-ASCII byte is
+// broken between glyphs, keeping its spacing; pure ASCII is broken between
+// words, and each run of whitespace becomes a single space.
+inline std::vector<TextLine> wrap_text(std::string_view text, int max_width) {
+    std::vector<TextLine> lines;
+    TextLine line;
+    const char* p = text.data();
+    const size_t n = text.size();
+    const size_t limit = max_width > 0 ? static_cast<size_t>(max_width) : 0;
+    // Lines are reserved at full width so appending never reallocates.
+    line.text.reserve(limit);
+    auto break_line = [&] {
+        line.padding = std::max(max_width - line.width, 0);
+        lines.push_back(std::move(line));
+        line = TextLine();
+        line.text.reserve(limit);
+    };
+
+    if (ascii_run_length(p, n) == n) {
+        auto is_space = [](char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
+        for (size_t i = 0; ; ) {
+            while (i < n && is_space(p[i])) {
+                ++i;
+            }
+            if (i == n) {
+                break;
+            }
+            const size_t start = i;
+            while (i < n && !is_space(p[i])) {
+                ++i;
+            }
+            const size_t word = i - start;
+            if (!line.text.empty() && static_cast<size_t>(line.width) + 1 + word > limit) {
+                break_line();
+            }
+            if (!line.text.empty()) {
+                line.text += ' ';
+                ++line.width;
+            }
+            line.text.append(p + start, word);
+            line.width += static_cast<int>(word);
+        }
+    } else {
+        for (size_t i = 0; i < n; ) {
+            // ASCII runs go in as whole slices, cut where the line fills up.
+            for (size_t run = ascii_run_length(p + i, n - i); run > 0; ) {
+                if (!line.text.empty() && static_cast<size_t>(line.width) >= limit) {
+                    break_line();
+                }
+                const size_t room = line.text.empty() ? std::max<size_t>(limit, 1) : limit - line.width;
+                const size_t take = std::min(room, run);
+                line.text.append(p + i, take);
+                line.width += static_cast<int>(take);
+                i += take;
+                run -= take;
+            }
+            if (i == n) {
+                break;
+            }
+            const TextGlyph glyph = next_glyph(p + i, n - i);
+            if (!line.text.empty() && static_cast<size_t>(line.width + glyph.width) > limit) {
+                break_line();
+            }
+            line.text.append(p + i, glyph.size);
+            line.width += glyph.width;
+            i += glyph.size;
+        }
+    }
+
+    if (!line.text.empty()) {
+        line.padding = std::max(max_width - line.width, 0);
+        lines.push_back(std::move(line));
+    }
+    return lines;
+}
+
+// text as a single line padded out to width columns.
+inline TextLine layout_line(std::string_view text, int width) {
+    TextLine line;
+    line.text.assign(text);
+    line.width = display_width(text);
+    line.padding = std::max(width - line.width, 0);
+    return line;
+}
+
+// Layouts of the text drawn in the dialogue box, keyed by (text, width).
+// The game's text is all fixed, so after warming up every frame is drawn
+// from here without measuring anything. References stay valid for the
+// life of the cache.
+class LayoutCache {
+public:
+    // wrap_text(text, width), computed on first use.
+    const std::vector<TextLine>& wrapped(std::string text, int width) {
+        LayoutKey key{std::move(text), width};
+        auto it = wrapped_.find(key);
+        if (it == wrapped_.end()) {
+            std::vector<TextLine> lines = wrap_text(key.text, width);
+            it = wrapped_.emplace(std::move(key), std::move(lines)).first;
+        }
+        return it->second;
+    }
+
+    // layout_line(text, width), computed on first use.
+    const TextLine& line(std::string text, int width) {
+        LayoutKey key{std::move(text), width};
+        auto it = lines_.find(key);
+        if (it == lines_.end()) {
+            TextLine laid_out = layout_line(key.text, width);
+            it = lines_.emplace(std::move(key), std::move(laid_out)).first;
+        }
+        return it->second;
+    }
+
+    size_t size() const { return wrapped_.size() + lines_.size(); }
+
+private:
+    struct LayoutKey {
+        std::string text;
+        int width;
+
+        bool operator==(const LayoutKey& other) const { return width == other.width && text == other.text; }
+    };
+    struct LayoutKeyHash {
+        size_t operator()(const LayoutKey& key) const {
+            return std::hash<std::string>()(key.text) ^ (static_cast<size_t>(key.width) * 0x9E3779B97F4A7C15ull);
+        }
+    };
+
+    std::unordered_map<LayoutKey, std::vector<TextLine>, LayoutKeyHash> wrapped_;
+    std::unordered_map<LayoutKey, TextLine, LayoutKeyHash> lines_;
+};
@@ -0,0 +1,831 @@
+// Shared VM core for the Project Memoria programs: machine state, the
+// GETC/PUTC plumbing and the reference interpreters. Each program picks its
+// opcode set, I/O and halt semantics through VmTraits and gets an
+// interpreter specialized for exactly that combination. With a suspending
+// I/O policy the interpreters return to the caller instead of blocking, and
+// the VirtualMachine alone is enough to resume them later.
+#pragma once
+
+#include <iostream>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Destination for PUTC. put() appends into the current window without a
+// virtual call; overflow() runs only when that window is full and either
+// makes room or reports that the byte has to be dropped.
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+
+    void put(char c) {
+        if (cursor_ == limit_ && !overflow()) {
+            return;
+        }
+        *cursor_++ = c;
+    }
+
+    virtual void flush() {}
+
+    // True when the window is full and the sink would rather be drained
+    // than grow or drop the next byte: a DrainSink waiting for the caller,
+    // or a MatchSink that has seen what it was told to stop at.
+    bool stalled() const { return stalls_ && cursor_ == limit_; }
+
+protected:
+    virtual bool overflow() = 0;
+
+    char* cursor_ = nullptr;
+    char* limit_ = nullptr;
+    bool stalls_ = false;
+};
+
+// Writes into a caller-supplied buffer and drops whatever does not fit.
+class BufferSink : public OutputSink {
+public:
+    BufferSink(char* data, size_t capacity) : data_(data) {
+        cursor_ = data;
+        limit_ = data + capacity;
+    }
+
+    std::string_view view() const { return std::string_view(data_, cursor_ - data_); }
+    bool truncated() const { return truncated_; }
+    void clear() { cursor_ = data_; truncated_ = false; }
+
+protected:
+    bool overflow() override {
+        truncated_ = true;
+        return false;
+    }
+
+private:
+    char* data_;
+    bool truncated_ = false;
+};
+
+// Owns a contiguous buffer that doubles whenever it fills up.
+class ArenaSink : public OutputSink {
+public:
+    explicit ArenaSink(size_t initial_capacity = 256) {
+        storage_.resize(initial_capacity > 0 ? initial_capacity : 1);
+        cursor_ = storage_.data();
+        limit_ = storage_.data() + storage_.size();
+    }
+
+    std::string_view view() const { return std::string_view(storage_.data(), size()); }
+    size_t size() const { return cursor_ - storage_.data(); }
+    void clear() { cursor_ = storage_.data(); }
+    void truncate(size_t size) { cursor_ = storage_.data() + size; }
+
+protected:
+    bool overflow() override {
+        const size_t used = size();
+        storage_.resize(storage_.size() * 2);
+        cursor_ = storage_.data() + used;
+        limit_ = storage_.data() + storage_.size();
+        return true;
+    }
+
+private:
+    std::vector<char> storage_;
+};
+
+// Fixed-size output for a resumable run: a full window stalls the VM until
+// the caller takes the bytes with view() and drain(). Run without a
+// suspending policy it drops what does not fit, like BufferSink.
+class DrainSink : public OutputSink {
+public:
+    explicit DrainSink(size_t capacity = 64) : storage_(capacity > 0 ? capacity : 1) {
+        stalls_ = true;
+        drain();
+    }
+    // The window points into storage_.
+    DrainSink(const DrainSink&) = delete;
+    DrainSink& operator=(const DrainSink&) = delete;
+
+    std::string_view view() const { return std::string_view(storage_.data(), cursor_ - storage_.data()); }
+    void drain() {
+        cursor_ = storage_.data();
+        limit_ = storage_.data() + storage_.size();
+    }
+
+protected:
+    bool overflow() override { return false; }
+
+private:
+    std::vector<char> storage_;
+};
+
+#ifndef _WIN32
+// Collects output in blocks and hands each block to write(2) in one call.
+class FdSink : public OutputSink {
+public:
+    explicit FdSink(int fd, size_t block_size = 64 * 1024) : fd_(fd), block_(block_size > 0 ? block_size : 1) {
+        cursor_ = block_.data();
+        limit_ = block_.data() + block_.size();
+    }
+
+    ~FdSink() override { flush(); }
+
+    void flush() override {
+        const char* p = block_.data();
+        while (p < cursor_) {
+            ssize_t n = write(fd_, p, cursor_ - p);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            p += n;
+        }
+        cursor_ = block_.data();
+    }
+
+protected:
+    bool overflow() override {
+        flush();
+        return true;
+    }
+
+private:
+    int fd_;
+    std::vector<char> block_;
+};
+#endif
+
+// Source for GETC. get() reads from the current window without a virtual
+// call; underflow() refills the window and returns false at end of input.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    bool get(char& c) {
+        if (cursor_ == limit_ && !underflow()) {
+            return false;
+        }
+        c = *cursor_++;
+        return true;
+    }
+
+    // True when every byte at hand is used up but more are on their way,
+    // so GETC should wait rather than see end of input. Only FeedInput
+    // ever starves.
+    bool starved() const { return starves_ && cursor_ == limit_; }
+
+protected:
+    virtual bool underflow() = 0;
+
+    const char* cursor_ = nullptr;
+    const char* limit_ = nullptr;
+    bool starves_ = false;
+};
+
+// Feeds GETC from a byte span owned by the caller.
+class SpanInput : public InputSource {
+public:
+    explicit SpanInput(std::string_view data = std::string_view()) { reset(data); }
+
+    void reset(std::string_view data) {
+        data_ = data.data();
+        cursor_ = data.data();
+        limit_ = data.data() + data.size();
+    }
+
+    size_t consumed() const { return cursor_ - data_; }
+    void seek(size_t offset) { cursor_ = data_ + offset; }
+
+protected:
+    bool underflow() override { return false; }
+
+private:
+    const char* data_ = nullptr;
+};
+
+// Input for a resumable run, fed by the caller as bytes arrive. Running out
+// of them suspends the VM instead of ending its input, until close().
+class FeedInput : public InputSource {
+public:
+    FeedInput() {
+        starves_ = true;
+        cursor_ = limit_ = buffer_.data();
+    }
+    // The window points into buffer_.
+    FeedInput(const FeedInput&) = delete;
+    FeedInput& operator=(const FeedInput&) = delete;
+
+    // Appends bytes, dropping the ones GETC has already taken.
+    void feed(std::string_view data) {
+        buffer_.erase(0, cursor_ - buffer_.data());
+        buffer_.append(data.data(), data.size());
+        cursor_ = buffer_.data();
+        limit_ = buffer_.data() + buffer_.size();
+    }
+
+    // No more input: a GETC past the last byte now sees end of input.
+    void close() { starves_ = false; }
+    bool closed() const { return !starves_; }
+
+protected:
+    bool underflow() override { return false; }
+
+private:
+    std::string buffer_;
+};
+
+#ifndef _WIN32
+// Refills from a file descriptor with one read(2) per block.
+class FdInput : public InputSource {
+public:
+    explicit FdInput(int fd, size_t block_size = 64 * 1024) : fd_(fd), block_(block_size > 0 ? block_size : 1) {}
+
+protected:
+    bool underflow() override {
+        for (;;) {
+            ssize_t n = read(fd_, block_.data(), block_.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            cursor_ = block_.data();
+            limit_ = block_.data() + n;
+            return true;
+        }
+    }
+
+private:
+    int fd_;
+    std::vector<char> block_;
+};
+#endif
+
+// Reads std::cin one character at a time, exactly like the built-in GETC,
+// so nothing past the VM's last GETC is taken away from later prompts.
+class StdinInput : public InputSource {
+protected:
+    bool underflow() override {
+        if (!(std::cin.get(last_))) {
+            return false;
+        }
+        cursor_ = &last_;
+        limit_ = &last_ + 1;
+        return true;
+    }
+
+private:
+    char last_ = 0;
+};
+
+class VmProfile;
+
+// Read-only view of a bytecode image. The interpreters take programs through
+// it, so a vector, a static array and a ProgramImage run without copying.
+class BytecodeView {
+public:
+    constexpr BytecodeView() = default;
+    constexpr BytecodeView(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+    BytecodeView(const std::vector<uint8_t>& bytes) : data_(bytes.data()), size_(bytes.size()) {}
+    template <size_t N>
+    constexpr BytecodeView(const uint8_t (&bytes)[N]) : data_(bytes), size_(N) {}
+    template <size_t N>
+    constexpr BytecodeView(const std::array<uint8_t, N>& bytes) : data_(bytes.data()), size_(N) {}
+
+    constexpr const uint8_t* data() const { return data_; }
+    constexpr size_t size() const { return size_; }
+    constexpr bool empty() const { return size_ == 0; }
+    constexpr const uint8_t& operator[](size_t i) const { return data_[i]; }
+    constexpr const uint8_t* begin() const { return data_; }
+    constexpr const uint8_t* end() const { return data_ + size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Time source for GET_TICK, in milliseconds. Callers pass the VM's retired
+// instruction count so deterministic clocks can derive time from it;
+// implementations must be safe to share between threads.
+class TickClock {
+public:
+    virtual ~TickClock() = default;
+    virtual uint32_t now_ms(uint64_t instructions) const = 0;
+};
+
+inline uint32_t steady_clock_ms() {
+    auto now = std::chrono::steady_clock::now();
+    auto duration = now.time_since_epoch();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+    return static_cast<uint32_t>(ms);
+}
+
+struct VirtualMachine {
+    uint32_t registers[4] = {0};
+    uint8_t memory[256] = {0};
+    uint16_t ip = 0;
+    bool zero_flag = false;
+    // Number of opcodes fetched so far; kept by every backend.
+    uint64_t instructions = 0;
+    // GETC reads std::cin and PUTC writes std::cout when nothing is attached.
+    InputSource* input = nullptr;
+    OutputSink* output = nullptr;
+    // Filled only by interpreters built with a profiling policy.
+    VmProfile* profile = nullptr;
+    // GET_TICK reads steady_clock when no clock is attached.
+    const TickClock* clock = nullptr;
+};
+
+// Snapshot of one run: the VM state plus how far it has read its input and
+// written its output. Small enough to take at every GETC.
+struct VmCheckpoint {
+    uint32_t registers[4] = {0};
+    uint8_t memory[256] = {0};
+    uint16_t ip = 0;
+    bool zero_flag = false;
+    uint64_t instructions = 0;
+    size_t input_offset = 0;
+    size_t output_size = 0;
+
+    void capture(const VirtualMachine& vm, size_t input_position, size_t output_position) {
+        memcpy(registers, vm.registers, sizeof(registers));
+        memcpy(memory, vm.memory, sizeof(memory));
+        ip = vm.ip;
+        zero_flag = vm.zero_flag;
+        instructions = vm.instructions;
+        input_offset = input_position;
+        output_size = output_position;
+    }
+
+    void capture(const VirtualMachine& vm, const SpanInput& input, const ArenaSink& output) {
+        capture(vm, input.consumed(), output.size());
+    }
+
+    // Leaves vm.input, vm.output and vm.profile alone.
+    void restore(VirtualMachine& vm) const {
+        memcpy(vm.registers, registers, sizeof(registers));
+        memcpy(vm.memory, memory, sizeof(memory));
+        vm.ip = ip;
+        vm.zero_flag = zero_flag;
+        vm.instructions = instructions;
+    }
+
+    void restore(VirtualMachine& vm, SpanInput& input, ArenaSink& output) const {
+        restore(vm);
+        input.seek(input_offset);
+        output.truncate(output_size);
+    }
+};
+
+inline bool vm_getc(VirtualMachine& vm, char& c) {
+    if (vm.input != nullptr) {
+        return vm.input->get(c);
+    }
+    return static_cast<bool>(std::cin.get(c));
+}
+
+// Backends call this with vm.instructions already counting the GET_TICK.
+inline uint32_t vm_get_tick(const VirtualMachine& vm) {
+    if (vm.clock != nullptr) {
+        return vm.clock->now_ms(vm.instructions);
+    }
+    return steady_clock_ms();
+}
+
+inline void vm_putc(VirtualMachine& vm, char c) {
+    if (vm.output != nullptr) {
+        vm.output->put(c);
+    } else {
+        std::cout << c;
+    }
+}
+
+// Threaded dispatch relies on the GNU "labels as values" extension.
+// Build with -DMEMORIA_FORCE_SWITCH_DISPATCH to use only the portable switch loops.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MEMORIA_FORCE_SWITCH_DISPATCH)
+#define MEMORIA_HAS_THREADED_DISPATCH 1
+#endif
+
+// Opcode-set policy: the opcodes an interpreter understands. Everything
+// else is treated as an unknown opcode and stops the VM.
+template <uint8_t... Opcodes>
+struct OpcodeSet {
+    static constexpr bool has(uint8_t opcode) { return ((opcode == Opcodes) || ...); }
+};
+
+// Why an interpreter returned. Only a suspending I/O policy ever yields
+// anything but Halted; the VM is then left on the GETC or PUTC that could
+// not go on, and running it again retries that instruction.
+enum class VmStatus : uint8_t {
+    Halted,
+    NeedInput,    // GETC found its FeedInput starved: feed() and resume
+    OutputFull,   // PUTC found its DrainSink stalled: drain() and resume
+};
+
+// I/O policy: GETC reads std::cin and PUTC writes std::cout directly.
+struct StreamIo {
+    static constexpr bool suspends = false;
+    static bool getc(VirtualMachine&, char& c) { return static_cast<bool>(std::cin.get(c)); }
+    static void putc(VirtualMachine&, char c) { std::cout << c; }
+};
+
+// I/O policy: GETC/PUTC go through vm.input/vm.output when attached.
+struct AttachedIo {
+    static constexpr bool suspends = false;
+    static bool getc(VirtualMachine& vm, char& c) { return vm_getc(vm, c); }
+    static void putc(VirtualMachine& vm, char c) { vm_putc(vm, c); }
+};
+
+// I/O policy: AttachedIo, but a starved input or a stalled output suspends
+// the interpreter, so a thread can keep any number of VMs waiting for a
+// human without blocking on one of them.
+struct SuspendingIo : AttachedIo {
+    static constexpr bool suspends = true;
+    static bool input_starved(const VirtualMachine& vm) { return vm.input != nullptr && vm.input->starved(); }
+    static bool output_stalled(const VirtualMachine& vm) { return vm.output != nullptr && vm.output->stalled(); }
+};
+
+// Halt policy: stopping leaves the registers alone and GETC keeps going
+// at end of input.
+struct PlainHalt {
+    static constexpr bool stop_on_eof = false;
+    static void stop(VirtualMachine&, uint32_t) {}
+};
+
+// Halt policy: every stop reports through r0 (1 for 0xFE, 0 for HALT,
+// unknown opcodes, end of bytecode and GETC at end of input).
+struct ResultHalt {
+    static constexpr bool stop_on_eof = true;
+    static void stop(VirtualMachine& vm, uint32_t result) { vm.registers[0] = result; }
+};
+
+// Profile policy: no instrumentation. The hooks are empty inline functions,
+// so interpreters built with it carry no profiling code at all.
+struct NoProfile {
+    static void instruction(VirtualMachine&, uint16_t, uint8_t) {}
+    static void branch(VirtualMachine&, uint16_t, bool) {}
+    static void finish(VirtualMachine&) {}
+};
+
+// Calls Profile::finish on every way out of an interpreter.
+template <class Profile>
+struct ProfileScope {
+    VirtualMachine& vm;
+    ~ProfileScope() { Profile::finish(vm); }
+};
+
+template <class Opcodes, class Io, class Halt, class Profile = NoProfile>
+struct VmTraits {
+    using opcodes = Opcodes;
+    using io = Io;
+    using halt = Halt;
+    using profile = Profile;
+};
+
+// Opcodes outside Traits::opcodes compile to a jump to the unknown-opcode
+// exit, so the interpreter carries no runtime feature checks.
+#define VM_CASE(opcode)                                     \
+    case opcode:                                            \
+        if constexpr (!Traits::opcodes::has(opcode)) {      \
+            goto unknown_opcode;                            \
+        } else
+
+// Steps back over an opcode fetched but not executed, so the next run
+// fetches it again. A profiling policy sees that fetch twice.
+#define VM_SUSPEND(status)          \
+    do {                            \
+        --vm.ip;                    \
+        --vm.instructions;          \
+        return status;              \
+    } while (0)
+
+template <class Traits>
+VmStatus run_vm_switch(VirtualMachine& vm, BytecodeView bytecode) {
+    using Io = typename Traits::io;
+    using Halt = typename Traits::halt;
+    using Profile = typename Traits::profile;
+    ProfileScope<Profile> profile_scope{vm};
+
+    while (true) {
+        if (vm.ip >= bytecode.size()) {
+            Halt::stop(vm, 0);
+            return VmStatus::Halted;
+        }
+        Profile::instruction(vm, vm.ip, bytecode[vm.ip]);
+        uint8_t opcode = bytecode[vm.ip++];
+        ++vm.instructions;
+
+        switch (opcode) {
+            VM_CASE(0x01) { // MOV_VAL reg, val
+                uint8_t reg_idx = bytecode[vm.ip++];
+                uint32_t value = 0;
+                memcpy(&value, &bytecode[vm.ip], 4);
+                vm.ip += 4;
+                vm.registers[reg_idx] = value;
+                break;
+            }
+            VM_CASE(0x04) { // STORE mem_addr, reg
+                uint8_t addr = bytecode[vm.ip++];
+                uint8_t reg_idx = bytecode[vm.ip++];
+                vm.memory[addr] = static_cast<uint8_t>(vm.registers[reg_idx]);
+                break;
+            }
+            VM_CASE(0x05) { // ADD reg1, reg2
+                uint8_t reg1_idx = bytecode[vm.ip++];
+                uint8_t reg2_idx = bytecode[vm.ip++];
+                vm.registers[reg1_idx] += vm.registers[reg2_idx];
+                break;
+            }
+            VM_CASE(0x06) { // SUB reg1, reg2
+                uint8_t reg1_idx = bytecode[vm.ip++];
+                uint8_t reg2_idx = bytecode[vm.ip++];
+                vm.registers[reg1_idx] -= vm.registers[reg2_idx];
+                break;
+            }
+            VM_CASE(0x07) { // XOR_REG reg1, reg2
+                uint8_t reg1_idx = bytecode[vm.ip++];
+                uint8_t reg2_idx = bytecode[vm.ip++];
+                vm.registers[reg1_idx] ^= vm.registers[reg2_idx];
+                break;
+            }
+            VM_CASE(0x09) { // CMP_MEM mem_addr, reg
+                uint8_t addr = bytecode[vm.ip++];
+                uint8_t reg_idx = bytecode[vm.ip++];
+                vm.zero_flag = (vm.memory[addr] == static_cast<uint8_t>(vm.registers[reg_idx]));
+                break;
+            }
+            VM_CASE(0x10) { // CMP_REG reg1, reg2
+                uint8_t reg1_idx = bytecode[vm.ip++];
+                uint8_t reg2_idx = bytecode[vm.ip++];
+                vm.zero_flag = (vm.registers[reg1_idx] == vm.registers[reg2_idx]);
+                break;
+            }
+            VM_CASE(0x11) { // JNZ address
+                uint16_t addr = 0;
+                memcpy(&addr, &bytecode[vm.ip], 2);
+                Profile::branch(vm, static_cast<uint16_t>(vm.ip - 1), !vm.zero_flag);
+                vm.ip += 2;
+                if (!vm.zero_flag) {
+                    vm.ip = addr;
+                }
+                break;
+            }
+            VM_CASE(0x12) { // CMP_VAL reg, val
+                uint8_t reg_idx = bytecode[vm.ip++];
+                uint32_t value = 0;
+                memcpy(&value, &bytecode[vm.ip], 4);
+                vm.ip += 4;
+                if (vm.registers[reg_idx] > value) {
+                    vm.zero_flag = false;
+                } else {
+                    vm.zero_flag = true;
+                }
+                break;
+            }
+            VM_CASE(0x20) { // GETC reg
+                if constexpr (Io::suspends) {
+                    if (Io::input_starved(vm)) {
+                        VM_SUSPEND(VmStatus::NeedInput);
+                    }
+                }
+                uint8_t reg_idx = bytecode[vm.ip++];
+                char c = 0;
+                if (!Io::getc(vm, c)) {
+                    if constexpr (Halt::stop_on_eof) {
+                        Halt::stop(vm, 0);
+                        return VmStatus::Halted;
+                    }
+                }
+                vm.registers[reg_idx] = c;
+                break;
+            }
+            VM_CASE(0x21) { // PUTC reg
+                if constexpr (Io::suspends) {
+                    if (Io::output_stalled(vm)) {
+                        VM_SUSPEND(VmStatus::OutputFull);
+                    }
+                }
+                uint8_t reg_idx = bytecode[vm.ip++];
+                Io::putc(vm, static_cast<char>(vm.registers[reg_idx]));
+                break;
+            }
+            VM_CASE(0x30) { // GET_TICK reg
+                uint8_t reg_idx = bytecode[vm.ip++];
+                vm.registers[reg_idx] = vm_get_tick(vm);
+                break;
+            }
+            VM_CASE(0xFE) {
+                Halt::stop(vm, 1);
+                return VmStatus::Halted;
+            }
+            VM_CASE(0xFF) { // HALT
+                Halt::stop(vm, 0);
+                return VmStatus::Halted;
+            }
+            default:
+                goto unknown_opcode;
+        }
+    }
+
+unknown_opcode:
+    Halt::stop(vm, 0);
+    return VmStatus::Halted;
+}
+
+#undef VM_CASE
+
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+template <class Traits>
+VmStatus run_vm_threaded(VirtualMachine& vm, BytecodeView bytecode) {
+    using Opcodes = typename Traits::opcodes;
+    using Io = typename Traits::io;
+    using Halt = typename Traits::halt;
+    using Profile = typename Traits::profile;
+    ProfileScope<Profile> profile_scope{vm};
+
+    // Built once, on the first call: every call after that starts straight
+    // at the first instruction, which matters for short resumed runs.
+#define TARGET(opcode)                                   \
+    (!Opcodes::has(opcode) ? &&op_invalid                \
+     : (opcode) == 0x01 ? &&op_mov_val                   \
+     : (opcode) == 0x04 ? &&op_store                     \
+     : (opcode) == 0x05 ? &&op_add                       \
+     : (opcode) == 0x06 ? &&op_sub                       \
+     : (opcode) == 0x07 ? &&op_xor_reg                   \
+     : (opcode) == 0x09 ? &&op_cmp_mem                   \
+     : (opcode) == 0x10 ? &&op_cmp_reg                   \
+     : (opcode) == 0x11 ? &&op_jnz                       \
+     : (opcode) == 0x12 ? &&op_cmp_val                   \
+     : (opcode) == 0x20 ? &&op_getc                      \
+     : (opcode) == 0x21 ? &&op_putc                      \
+     : (opcode) == 0x30 ? &&op_get_tick                  \
+     : (opcode) == 0xFE ? &&op_fail                      \
+     : (opcode) == 0xFF ? &&op_halt                      \
+                        : &&op_invalid)
+#define ROW(high)                                                                   \
+    TARGET(high | 0x0), TARGET(high | 0x1), TARGET(high | 0x2), TARGET(high | 0x3), \
+    TARGET(high | 0x4), TARGET(high | 0x5), TARGET(high | 0x6), TARGET(high | 0x7), \
+    TARGET(high | 0x8), TARGET(high | 0x9), TARGET(high | 0xA), TARGET(high | 0xB), \
+    TARGET(high | 0xC), TARGET(high | 0xD), TARGET(high | 0xE), TARGET(high | 0xF)
+    static const void* const dispatch_table[256] = {
+        ROW(0x00), ROW(0x10), ROW(0x20), ROW(0x30), ROW(0x40), ROW(0x50), ROW(0x60), ROW(0x70),
+        ROW(0x80), ROW(0x90), ROW(0xA0), ROW(0xB0), ROW(0xC0), ROW(0xD0), ROW(0xE0), ROW(0xF0),
+    };
+#undef ROW
+#undef TARGET
+
+    const uint8_t* code = bytecode.data();
+    const size_t code_size = bytecode.size();
+
+    // Every handler ends in its own indirect jump, so each one gets a separate
+    // branch predictor entry instead of sharing the single switch jump.
+#define DISPATCH()                                      \
+    do {                                                \
+        if (vm.ip >= code_size) goto op_end;            \
+        Profile::instruction(vm, vm.ip, code[vm.ip]);   \
+        ++vm.instructions;                              \
+        goto *dispatch_table[code[vm.ip++]];            \
+    } while (0)
+
+    DISPATCH();
+
+op_mov_val: {
+        uint8_t reg_idx = code[vm.ip++];
+        uint32_t value = 0;
+        memcpy(&value, &code[vm.ip], 4);
+        vm.ip += 4;
+        vm.registers[reg_idx] = value;
+        DISPATCH();
+    }
+op_store: {
+        uint8_t addr = code[vm.ip++];
+        uint8_t reg_idx = code[vm.ip++];
+        vm.memory[addr] = static_cast<uint8_t>(vm.registers[reg_idx]);
+        DISPATCH();
+    }
+op_add: {
+        uint8_t reg1_idx = code[vm.ip++];
+        uint8_t reg2_idx = code[vm.ip++];
+        vm.registers[reg1_idx] += vm.registers[reg2_idx];
+        DISPATCH();
+    }
+op_sub: {
+        uint8_t reg1_idx = code[vm.ip++];
+        uint8_t reg2_idx = code[vm.ip++];
+        vm.registers[reg1_idx] -= vm.registers[reg2_idx];
+        DISPATCH();
+    }
+op_xor_reg: {
+        uint8_t reg1_idx = code[vm.ip++];
+        uint8_t reg2_idx = code[vm.ip++];
+        vm.registers[reg1_idx] ^= vm.registers[reg2_idx];
+        DISPATCH();
+    }
+op_cmp_mem: {
+        uint8_t addr = code[vm.ip++];
+        uint8_t reg_idx = code[vm.ip++];
+        vm.zero_flag = (vm.memory[addr] == static_cast<uint8_t>(vm.registers[reg_idx]));
+        DISPATCH();
+    }
+op_cmp_reg: {
+        uint8_t reg1_idx = code[vm.ip++];
+        uint8_t reg2_idx = code[vm.ip++];
+        vm.zero_flag = (vm.registers[reg1_idx] == vm.registers[reg2_idx]);
+        DISPATCH();
+    }
+op_jnz: {
+        uint16_t addr = 0;
+        memcpy(&addr, &code[vm.ip], 2);
+        Profile::branch(vm, static_cast<uint16_t>(vm.ip - 1), !vm.zero_flag);
+        vm.ip += 2;
+        if (!vm.zero_flag) {
+            vm.ip = addr;
+        }
+        DISPATCH();
+    }
+op_cmp_val: {
+        uint8_t reg_idx = code[vm.ip++];
+        uint32_t value = 0;
+        memcpy(&value, &code[vm.ip], 4);
+        vm.ip += 4;
+        vm.zero_flag = !(vm.registers[reg_idx] > value);
+        DISPATCH();
+    }
+op_getc: {
+        if constexpr (Io::suspends) {
+            if (Io::input_starved(vm)) {
+                VM_SUSPEND(VmStatus::NeedInput);
+            }
+        }
+        uint8_t reg_idx = code[vm.ip++];
+        char c = 0;
+        if (!Io::getc(vm, c)) {
+            if constexpr (Halt::stop_on_eof) {
+                Halt::stop(vm, 0);
+                return VmStatus::Halted;
+            }
+        }
+        vm.registers[reg_idx] = c;
+        DISPATCH();
+    }
+op_putc: {
+        if constexpr (Io::suspends) {
+            if (Io::output_stalled(vm)) {
+                VM_SUSPEND(VmStatus::OutputFull);
+            }
+        }
+        uint8_t reg_idx = code[vm.ip++];
+        Io::putc(vm, static_cast<char>(vm.registers[reg_idx]));
+        DISPATCH();
+    }
+op_get_tick: {
+        uint8_t reg_idx = code[vm.ip++];
+        vm.registers[reg_idx] = vm_get_tick(vm);
+        DISPATCH();
+    }
+op_fail:
+    Halt::stop(vm, 1);
+    return VmStatus::Halted;
+op_halt:
+op_invalid:
+op_end:
+    Halt::stop(vm, 0);
+    return VmStatus::Halted;
+
+#undef DISPATCH
+}
+#endif
+
+#undef VM_SUSPEND
+
+// Which interpreter runs a program. This file has the two bytecode loops;
+// memoria_backends.hpp adds Decoded and Jit for the Hakoniwa VM.
+enum class DispatchMode {
+    Switch,
+    Threaded,
+    Decoded,
+    Jit,
+};
+
+// The faster of the two loops wherever threaded dispatch is built.
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+const DispatchMode default_loop_mode = DispatchMode::Threaded;
+#else
+const DispatchMode default_loop_mode = DispatchMode::Switch;
+#endif
+
+// Runs the threaded loop for DispatchMode::Threaded when it is built, and
+// the switch loop for everything else.
+template <class Traits>
+VmStatus run_vm(VirtualMachine& vm, BytecodeView bytecode, DispatchMode mode = default_loop_mode) {
+#ifdef MEMORIA_HAS_THREADED_DISPATCH
+    if (mode == DispatchMode::Threaded) {
+        return run_vm_threaded<Traits>(vm, bytecode);
+    }
+#else
+    (void)mode;
+#endif
+    return run_vm_switch<Traits>(vm, bytecode);
+}